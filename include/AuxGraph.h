@@ -1,59 +1,80 @@
 #ifndef AUXGRAPH_H
 #define AUXGRAPH_H
 
+#include "llvm/ADT/APInt.h"
+#include "llvm/ADT/ArrayRef.h"
 #include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/DenseSet.h"
 #include "llvm/ADT/MapVector.h"
 #include "llvm/ADT/SetVector.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Function.h"
+#include "llvm/Support/raw_ostream.h"
 
-#include <unordered_map>
+#include <vector>
 
 using namespace llvm;
 
 namespace epp {
 
+/// An edge of the AuxGraph. Weights and path counts are 64 bit, like the
+/// counter the instrumentation increments.
 struct Edge {
     BasicBlock *src, *tgt;
     bool real;
+    uint64_t weight;
     Edge(BasicBlock *from, BasicBlock *to, bool r = true)
-        : src(from), tgt(to), real(r) {}
+        : src(from), tgt(to), real(r), weight(0) {}
 };
 
-typedef std::shared_ptr<Edge> EdgePtr;
+/// Index of an edge in the edge array of an AuxGraph.
+typedef uint32_t EdgeId;
+
+/// An edge A->B of the CFG which is replaced by the edges A->Exit and
+/// Entry->B in the AuxGraph.
+struct Segment {
+    BasicBlock *src, *tgt;
+    EdgeId AExit, EntryB;
+};
 
 // An auxiliary graph representation of the CFG of a function which
-// will be queried online during instrumentation. Edges in the graph
-// will need to be updated as instrumentation changes the basic block
-// pointers used to represent a particular edge/node.
+// will be queried online during instrumentation. Nodes are numbered in
+// post order and the edges are kept in one array grouped by their source
+// node, so the successors of a node are a contiguous slice of the array.
+// The graph is rebuilt once when edges are segmented, after that only
+// the edge weights change.
 class AuxGraph {
 
     SmallVector<BasicBlock *, 32> Nodes;
-    DenseMap<const BasicBlock *, SmallVector<EdgePtr, 4>> EdgeList;
-    std::unordered_map<EdgePtr, std::pair<EdgePtr, EdgePtr>> SegmentMap;
-    std::unordered_map<EdgePtr, APInt> Weights;
+    DenseMap<const BasicBlock *, uint32_t> NodeIds;
+    std::vector<Edge> Edges;
+    SmallVector<uint32_t, 33> Offsets;
+    SmallVector<Segment, 8> Segments;
     BasicBlock *FakeExit;
 
+    SmallVector<EdgeId, 32> build(ArrayRef<Edge> List);
+
   public:
     void clear();
     void init(Function &F);
-    EdgePtr add(BasicBlock *src, BasicBlock *tgt, bool isReal = true);
     void
     segment(SetVector<std::pair<const BasicBlock *, const BasicBlock *>> &List);
-    //void printWeights();
-    void dot(raw_ostream &os) const;
-    void dotW(raw_ostream &os) const;
-    SmallVector<EdgePtr, 4> succs(BasicBlock *B) const;
-    SmallVector<std::pair<EdgePtr, APInt>, 16> getWeights() const;
-    APInt getEdgeWeight(const EdgePtr &Ptr) const;
-    std::unordered_map<EdgePtr, std::pair<EdgePtr, EdgePtr>> getSegmentMap() const;
-    EdgePtr exists(BasicBlock *Src, BasicBlock *Tgt, bool isReal) const;
-    EdgePtr getOrInsertEdge(BasicBlock *Src, BasicBlock *Tgt, bool isReal);
-
-    bool isExitBlock(BasicBlock *B) const { return B == FakeExit; }
-    SmallVector<BasicBlock *, 32> nodes() const { return Nodes; }
-    APInt &operator[](const EdgePtr &E) { return Weights[E]; }
+    void dot(raw_ostream &os = errs()) const;
+    void dotW(raw_ostream &os = errs()) const;
+    ArrayRef<Edge> succs(const BasicBlock *B) const;
+    MutableArrayRef<Edge> succs(const BasicBlock *B);
+    SmallVector<const Edge *, 16> getWeights() const;
+
+    bool isExitBlock(const BasicBlock *B) const { return B == FakeExit; }
+    ArrayRef<BasicBlock *> nodes() const { return Nodes; }
+    ArrayRef<Edge> edges() const { return Edges; }
+    ArrayRef<Segment> segments() const { return Segments; }
+    const Edge &operator[](EdgeId Id) const { return Edges[Id]; }
 };
+
+/// Assign the Ball-Larus edge weights of a segmented AuxGraph and compute
+/// the number of paths from each node. Returns false if the number of
+/// paths does not fit in 64 bits.
+bool numberPaths(AuxGraph &AG, DenseMap<BasicBlock *, uint64_t> &NumPaths);
 }
 #endif
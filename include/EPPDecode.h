@@ -2,32 +2,45 @@
 #define EPPDECODE_H
 
 #include "llvm/ADT/APInt.h"
+#include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Pass.h"
 
 #include "EPPEncode.h"
+#include "FunctionEncoding.h"
 #include <map>
+#include <memory>
 #include <vector>
 
 namespace epp {
 
-enum PathType { RIRO, FIRO, RIFO, FIFO };
-
 struct Path {
-    APInt Id;
+    uint64_t Id;
     uint64_t Freq;
     PathType Type;
     std::vector<BasicBlock *> Blocks;
+    /// The target of the segmented edge which ends the path, null if the
+    /// path ends with a return.
+    BasicBlock *Next = nullptr;
 };
 
 struct EPPDecode : public llvm::ModulePass {
     static char ID;
     //std::string filename;
 
-    DenseMap<uint32_t, Function *> FunctionIdToPtr;
-    llvm::DenseMap<llvm::Function *, llvm::SmallVector<Path, 16>> DecodeCache;
+    // The encoding of a function computed from the module, and the
+    // block of each of its nodes.
+    struct DecodeCacheEntry {
+        FunctionEncoding Encoding;
+        std::vector<llvm::BasicBlock *> Blocks;
+    };
+
+    DenseMap<uint64_t, Function *> FunctionIdToPtr;
+    // Encoding a function is far more expensive than decoding a path, so
+    // every function is encoded at most once.
+    DenseMap<uint64_t, std::unique_ptr<DecodeCacheEntry>> DecodeCache;
 
     EPPDecode() : llvm::ModulePass(ID) {}
 
@@ -38,13 +51,24 @@ struct EPPDecode : public llvm::ModulePass {
     virtual bool runOnModule(llvm::Module &m) override;
     bool doInitialization(llvm::Module &m) override;
 
-    void getPathInfo(uint32_t FunctionId, Path& Info);
-
-    std::pair<PathType, std::vector<llvm::BasicBlock *>>
-    decode(llvm::Function &F, llvm::APInt pathID, EPPEncode &E);
+    const FunctionEncoding *getEncoding(uint64_t FunctionId);
+    void getPathInfo(uint64_t FunctionId, Path &Info);
+    void getPathInfo(uint64_t FunctionId, llvm::MutableArrayRef<Path> Paths);
 
+    void releaseMemory() override { DecodeCache.clear(); }
     llvm::StringRef getPassName() const override { return "EPPDecode"; }
+
+  private:
+    DecodeCacheEntry *getCacheEntry(uint64_t FunctionId);
 };
+
+/// Decode the paths of each function of a profile whose encoding matches
+/// the module, and pass them to Callback one function at a time. Loop
+/// windows are skipped.
+void decodeProfile(
+    EPPDecode &D, llvm::StringRef ProfileFilename,
+    llvm::function_ref<void(llvm::Function &, llvm::MutableArrayRef<Path>)>
+        Callback);
 }
 
 #endif
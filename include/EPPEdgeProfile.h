@@ -0,0 +1,52 @@
+#ifndef EPPEDGEPROFILE_H
+#define EPPEDGEPROFILE_H
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+#include "EPPDecode.h"
+
+namespace epp {
+
+/// Folds the paths of a profile into execution counts of the blocks and
+/// edges of the module, which must be prepared as it was for
+/// instrumentation. The counts are attached to the module as branch
+/// weights and function entry counts, or written as a sample profile.
+/// copyBranchWeights moves the weights back to the unprepared module.
+struct EPPEdgeProfile : public llvm::ModulePass {
+    static char ID;
+
+    typedef std::pair<const llvm::BasicBlock *, const llvm::BasicBlock *>
+        EdgeTy;
+
+    llvm::DenseMap<const llvm::BasicBlock *, uint64_t> BlockCounts;
+    llvm::DenseMap<EdgeTy, uint64_t> EdgeCounts;
+    // Functions with executed paths in the profile.
+    llvm::DenseSet<const llvm::Function *> Profiled;
+
+    EPPEdgeProfile() : llvm::ModulePass(ID) {}
+
+    virtual void getAnalysisUsage(llvm::AnalysisUsage &au) const override {
+        au.addRequired<EPPDecode>();
+        au.addRequired<EPPEncode>();
+    }
+
+    virtual bool runOnModule(llvm::Module &m) override;
+    void fold(llvm::Function &F, llvm::ArrayRef<Path> Paths);
+    void setBranchWeights(llvm::Function &F);
+    void writeSampleProfile(llvm::Module &M, llvm::raw_ostream &OS);
+
+    llvm::StringRef getPassName() const override { return "EPPEdgeProfile"; }
+};
+
+/// Copy the branch weights and entry counts of a prepared module to the
+/// copy VMap maps it to, taken before preparation. Preparing only routes
+/// the branches of the module through new blocks, a branch whose
+/// successors no longer lead to those of its copy is left unweighted.
+void copyBranchWeights(llvm::Module &Prepared, llvm::ValueToValueMapTy &VMap);
+}
+
+#endif
@@ -13,6 +13,7 @@
 #include "llvm/Transforms/Utils/UnifyFunctionExitNodes.h"
 
 #include <map>
+#include <memory>
 #include <unordered_map>
 
 //#include "AltCFG.h"
@@ -20,16 +21,25 @@
 
 namespace epp {
 
+uint64_t getFunctionGUID(const llvm::Function &F);
+
 struct EPPEncode : public llvm::FunctionPass {
 
     static char ID;
 
     llvm::LoopInfo *LI;
-    llvm::DenseMap<llvm::BasicBlock *, llvm::APInt> numPaths;
+    llvm::DenseMap<llvm::BasicBlock *, uint64_t> numPaths;
     // altcfg ACFG;
     AuxGraph AG;
+    // Innermost loops of the function. The position of a loop in this
+    // list is the loop id used by k-iteration loop path profiling.
+    llvm::SmallVector<llvm::Loop *, 4> InnermostLoops;
+    // Loop info owned by an encoding computed outside of a pass manager.
+    std::unique_ptr<llvm::LoopInfo> OwnedLI;
+    // Structural hash of the encoded CFG, saved with the profile.
+    uint64_t CFGHash;
 
-    EPPEncode() : llvm::FunctionPass(ID), LI(nullptr) {}
+    EPPEncode() : llvm::FunctionPass(ID), LI(nullptr), CFGHash(0) {}
 
     virtual void getAnalysisUsage(llvm::AnalysisUsage &au) const override {
         au.addRequired<llvm::LoopInfoWrapperPass>();
@@ -38,6 +48,10 @@ struct EPPEncode : public llvm::FunctionPass {
 
     virtual bool runOnFunction(llvm::Function &f) override;
     void encode(llvm::Function &f);
+    static std::unique_ptr<EPPEncode> compute(llvm::Function &F);
+    llvm::Loop *getBackEdgeLoop(llvm::BasicBlock *Src,
+                                llvm::BasicBlock *Tgt) const;
+    int getLoopId(const llvm::Loop *L) const;
     bool doInitialization(llvm::Module &m) override;
     bool doFinalization(llvm::Module &m) override;
     void releaseMemory() override;
@@ -0,0 +1,38 @@
+#ifndef EPPOUTLINE_H
+#define EPPOUTLINE_H
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+
+#include "EPPDecode.h"
+
+namespace epp {
+
+/// Outlines the hottest paths of a profile into functions of their own.
+/// The path is first made a superblock, the blocks of which are then
+/// extracted: every branch off the path returns from the outlined function
+/// with the id of the exit taken, and the values still needed after it are
+/// stored through pointer arguments. The original function calls the
+/// outlined path and dispatches on the exit id. The module must be prepared
+/// as it was for instrumentation.
+struct EPPOutline : public llvm::ModulePass {
+    static char ID;
+
+    unsigned NumOutlined = 0;
+
+    EPPOutline() : llvm::ModulePass(ID) {}
+
+    virtual void getAnalysisUsage(llvm::AnalysisUsage &au) const override {
+        au.addRequired<EPPDecode>();
+        au.addRequired<EPPEncode>();
+    }
+
+    virtual bool runOnModule(llvm::Module &m) override;
+    void outlineTraces(llvm::Function &F,
+                       llvm::ArrayRef<std::vector<llvm::BasicBlock *>> Traces);
+
+    llvm::StringRef getPassName() const override { return "EPPOutline"; }
+};
+}
+
+#endif
@@ -1,21 +1,78 @@
 #ifndef EPPPATHPRINTER_H
 #define EPPPATHPRINTER_H
 
-#include "llvm/ADT/APInt.h"
+#include "llvm/ADT/DenseSet.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Pass.h"
 
 #include "EPPDecode.h"
+#include "FunctionEncoding.h"
+#include "ProfileReader.h"
+#include <functional>
 #include <map>
+#include <memory>
+#include <string>
 #include <vector>
 
 namespace epp {
 
+enum OutputFormat { YAMLFormat, JSONFormat, BinaryFormat };
+
+struct DecodedPath;
+class PathWriter;
+
+/// Decodes the paths of a profile and prints them with their source
+/// locations. The encoding of a function is looked up by its GUID, either
+/// computed from the module or read from the encoding file. The returned
+/// encodings have to stay valid until the profile is printed, as the
+/// functions are decoded on Jobs threads after all the lookups. The paths
+/// are written in the given format.
+class ProfilePrinter {
+  public:
+    typedef std::function<const FunctionEncoding *(uint64_t)> LookupTy;
+
+    /// The records of one function or loop section of the profile.
+    struct Section {
+        /// Null if the records are skipped.
+        const FunctionEncoding *FE = nullptr;
+        bool IsLoop                = false;
+        uint32_t LoopId            = 0;
+        uint32_t K                 = 0;
+        /// The path ids of a function, or the K path ids of each window.
+        std::vector<uint64_t> PathIds;
+        /// The frequency of each path, or of each window.
+        std::vector<uint64_t> Freqs;
+        std::string Output;
+    };
+
+  private:
+    LookupTy Lookup;
+    unsigned Jobs;
+    std::unique_ptr<PathWriter> Writer;
+    /// Where the notes about skipped functions go.
+    llvm::raw_ostream *Notes = nullptr;
+    /// Functions whose profile does not match the encoding.
+    DenseSet<uint64_t> StaleFunctions;
+
+    void checkFunction(const ProfileSection &Entry);
+    void note(Section &S, const llvm::Twine &Note);
+    bool lookupSection(uint64_t FunctionId, Section &S);
+    void readFunctionSection(const ProfileSection &Header,
+                             ProfileReader &Reader, Section &S);
+    void readLoopSection(const ProfileSection &Header, ProfileReader &Reader,
+                         Section &S);
+
+  public:
+    explicit ProfilePrinter(LookupTy L, unsigned Jobs = 1,
+                            OutputFormat Format = YAMLFormat);
+    ~ProfilePrinter();
+    void print(ProfileReader &Reader, llvm::raw_ostream &OS);
+};
+
 struct EPPPathPrinter : public llvm::ModulePass {
     static char ID;
-    DenseMap<uint32_t, Function *> FunctionIdToPtr;
     EPPPathPrinter() : llvm::ModulePass(ID) {}
 
     virtual void getAnalysisUsage(llvm::AnalysisUsage &au) const override {
@@ -24,9 +81,21 @@ struct EPPPathPrinter : public llvm::ModulePass {
     }
 
     virtual bool runOnModule(llvm::Module &m) override;
-    bool doInitialization(llvm::Module &m) override;
     llvm::StringRef getPassName() const override { return "EPPPathPrinter"; }
 };
+
+/// Decode a profile with the encoding file written when the module was
+/// instrumented, without the module itself.
+void printProfileWithEncodingFile(llvm::StringRef ProfileFilename,
+                                  llvm::StringRef EncodingFilename);
+
+/// Decode only the paths of the functions with the given name. The index
+/// at the end of the profile gives the byte ranges of their sections, so
+/// that nothing else of the profile is read, and only their encodings are
+/// parsed.
+void queryProfile(llvm::StringRef ProfileFilename,
+                  llvm::StringRef EncodingFilename,
+                  llvm::StringRef FunctionName);
 }
 
 #endif
@@ -5,16 +5,41 @@
 #include "llvm/IR/Module.h"
 #include "llvm/Pass.h"
 
+#include <string>
+
 #include "EPPEncode.h"
 
 namespace epp {
+
+/// The longest window of consecutive loop iterations the runtime records,
+/// the bound of -k. Must match MaxLoopIterations in Runtime.cpp.
+const unsigned MaxLoopIterations = 16;
+
 struct EPPProfile : public llvm::ModulePass {
     static char ID;
 
+    /// When several modules are instrumented at once, each on a thread of
+    /// its own, the report and the encodings of a module are kept here
+    /// instead of written to stderr and the encoding file.
+    struct BatchOutput {
+        std::string Report;
+        std::string Encodings;
+    };
+
     llvm::LoopInfo *LI;
     llvm::DenseMap<llvm::Function *, uint64_t> FunctionIds;
-
-    EPPProfile() : llvm::ModulePass(ID), LI(nullptr) {}
+    // Number of paths and CFG hash of each function, saved in the
+    // function table of the profile.
+    llvm::DenseMap<llvm::Function *, std::pair<uint64_t, uint64_t>>
+        FunctionInfo;
+    // The id of the first function of the module in the runtime, set by
+    // the module constructor. Functions log their id relative to it, so
+    // that instrumented modules can be linked together.
+    llvm::GlobalVariable *FunctionBase = nullptr;
+    BatchOutput *Batch;
+
+    explicit EPPProfile(BatchOutput *Batch = nullptr)
+        : llvm::ModulePass(ID), LI(nullptr), Batch(Batch) {}
 
     virtual void getAnalysisUsage(llvm::AnalysisUsage &au) const override {
         // au.addRequired<llvm::LoopInfoWrapperPass>();
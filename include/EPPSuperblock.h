@@ -0,0 +1,64 @@
+#ifndef EPPSUPERBLOCK_H
+#define EPPSUPERBLOCK_H
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+
+#include "EPPDecode.h"
+
+namespace epp {
+
+typedef llvm::DenseMap<llvm::Function *,
+                       std::vector<std::vector<llvm::BasicBlock *>>>
+    TraceMap;
+
+/// The blocks of the N most frequent paths of each function of a profile,
+/// hottest first.
+TraceMap getHotTraces(EPPDecode &D, llvm::StringRef ProfileFilename,
+                      unsigned N);
+
+/// Whether the blocks of a trace are still joined by edges, and none of
+/// them is part of a trace already transformed.
+bool isTraceAvailable(llvm::ArrayRef<llvm::BasicBlock *> Trace,
+                      const llvm::SmallPtrSetImpl<llvm::BasicBlock *> &Used);
+
+/// Turn a trace into a superblock entered only at its head, duplicating up
+/// to Budget instructions. The blocks of the superblock, which may end
+/// before the trace does, at a loop header or when the budget runs out, are
+/// appended to Superblock. Returns the number of instructions duplicated.
+unsigned
+formSuperblock(llvm::ArrayRef<llvm::BasicBlock *> Trace, unsigned Budget,
+               llvm::SmallVectorImpl<llvm::BasicBlock *> *Superblock = nullptr);
+
+/// Forms superblocks along the hottest paths of a profile: the blocks of a
+/// path after its first side entrance are tail duplicated, so that the path
+/// becomes a chain of blocks entered only at its head. Later passes can then
+/// optimize the path without the merge points it used to go through. The
+/// module must be prepared as it was for instrumentation.
+struct EPPSuperblock : public llvm::ModulePass {
+    static char ID;
+
+    /// Number of superblocks formed and of instructions duplicated.
+    unsigned NumSuperblocks = 0;
+    unsigned NumDuplicated  = 0;
+
+    EPPSuperblock() : llvm::ModulePass(ID) {}
+
+    virtual void getAnalysisUsage(llvm::AnalysisUsage &au) const override {
+        au.addRequired<EPPDecode>();
+        au.addRequired<EPPEncode>();
+    }
+
+    virtual bool runOnModule(llvm::Module &m) override;
+    void
+    formSuperblocks(llvm::Function &F,
+                    llvm::ArrayRef<std::vector<llvm::BasicBlock *>> Traces);
+
+    llvm::StringRef getPassName() const override { return "EPPSuperblock"; }
+};
+}
+
+#endif
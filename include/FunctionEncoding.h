@@ -0,0 +1,116 @@
+#ifndef FUNCTIONENCODING_H
+#define FUNCTIONENCODING_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <istream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace epp {
+
+struct EPPEncode;
+
+enum PathType { RIRO, FIRO, RIFO, FIFO };
+
+// The encoding of a function with everything needed to decode and print
+// its paths, but without references to the IR. It is written to the
+// encoding file at instrumentation time so that a profile can be decoded
+// without the module. Nodes are the AuxGraph nodes in post order, the
+// fake exit is the first node and the entry block the last one.
+struct FunctionEncoding {
+    static const uint32_t NoNode = ~0u;
+
+    struct SuccEdge {
+        uint32_t Tgt;
+        uint64_t Weight;
+        bool Real;
+        // For the edges A->Exit and Entry->B replacing a segmented edge
+        // A->B, the node at the other end, B and A respectively.
+        uint32_t SegmentNode;
+    };
+
+    // The nodes of a decoded path. A path which ends with a segmented
+    // edge A->B continues with the next path at B. Ids which do not
+    // decode are not Valid and have no nodes.
+    struct NodePath {
+        bool Valid    = true;
+        PathType Type = RIRO;
+        std::vector<uint32_t> Nodes;
+        uint32_t Next = NoNode;
+    };
+
+    struct Location {
+        uint32_t File;
+        unsigned Line;
+
+        bool operator==(const Location &L) const {
+            return File == L.File && Line == L.Line;
+        }
+        bool operator!=(const Location &L) const { return !(*this == L); }
+    };
+
+    uint64_t GUID     = 0;
+    uint64_t NumPaths = 0;
+    uint64_t CFGHash  = 0;
+    std::string Name;
+    // The successors of node I are Edges[Offsets[I]] to Edges[Offsets[I+1]],
+    // sorted by weight.
+    std::vector<uint32_t> Offsets;
+    std::vector<SuccEdge> Edges;
+    // Number of paths from each node to the exit, set by finalize().
+    std::vector<uint64_t> NodePaths;
+    // The source locations of the instructions of node I, consecutive
+    // duplicates removed, are Locs[LocOffsets[I]] to Locs[LocOffsets[I+1]].
+    // Locations refer to the file names by index.
+    std::vector<uint32_t> LocOffsets;
+    std::vector<Location> Locs;
+    std::vector<std::string> Files;
+    // Names of the blocks, empty for the fake exit.
+    std::vector<std::string> BlockNames;
+    // Names of the headers of the innermost loops, indexed by loop id.
+    std::vector<std::string> LoopHeaders;
+
+    static FunctionEncoding get(llvm::Function &F, const EPPEncode &Enc);
+    void finalize();
+
+    uint32_t numNodes() const { return Offsets.size() - 1; }
+    uint32_t entry() const { return numNodes() - 1; }
+    bool isExit(uint32_t N) const { return N == 0; }
+    llvm::ArrayRef<SuccEdge> succs(uint32_t N) const;
+    llvm::ArrayRef<Location> locations(uint32_t N) const;
+    NodePath decode(uint64_t PathId) const;
+    std::vector<NodePath> decode(llvm::ArrayRef<uint64_t> PathIds) const;
+    void getPathSrc(llvm::ArrayRef<uint32_t> Nodes,
+                    std::vector<Location> &PathLocs) const;
+    void printPathSrc(llvm::ArrayRef<uint32_t> Nodes, llvm::raw_ostream &out,
+                      llvm::StringRef prefix) const;
+};
+
+void writeFunctionEncoding(llvm::raw_ostream &OS, const FunctionEncoding &FE);
+bool readFunctionEncoding(std::istream &In, FunctionEncoding &FE,
+                          const llvm::DenseSet<uint64_t> *Wanted = nullptr);
+
+typedef llvm::DenseMap<uint64_t, std::unique_ptr<FunctionEncoding>>
+    EncodingMap;
+
+/// Read the functions of an encoding file, all of them or only those
+/// Wanted, keyed by GUID. A function which appears more than once was
+/// instrumented again and its last encoding is used. A file which cannot
+/// be opened is a fatal error.
+EncodingMap readEncodingFile(llvm::StringRef Filename,
+                             const llvm::DenseSet<uint64_t> *Wanted = nullptr);
+
+/// Append the encodings of a module to an encoding file. The modules
+/// instrumented with the same profile, in separate invocations or plugin
+/// compiles, share the file, so each is appended in a single write.
+void appendEncodingFile(llvm::StringRef Filename, llvm::StringRef Encodings);
+}
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef PROFILEDIFF_H
+#define PROFILEDIFF_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <functional>
+
+#include "FunctionEncoding.h"
+
+namespace epp {
+
+enum DiffRanking { AbsoluteChange, RelativeChange };
+
+/// Compares the path frequencies of two profiles of the same program. The
+/// profiles are read side by side, one function at a time. Paths whose
+/// frequency changed, including the paths only executed in one of the
+/// profiles, are ranked by the absolute or the relative change, and only
+/// the listed paths are decoded. Functions whose CFG differs between the
+/// profiles are reported without comparing their paths.
+class ProfileDiff {
+  public:
+    typedef std::function<const FunctionEncoding *(uint64_t)> LookupTy;
+
+  private:
+    LookupTy Lookup;
+    DiffRanking Ranking;
+    unsigned Top;
+
+  public:
+    /// Top limits the number of paths listed, 0 for all of them.
+    ProfileDiff(LookupTy L, DiffRanking R = AbsoluteChange, unsigned Top = 0)
+        : Lookup(std::move(L)), Ranking(R), Top(Top) {}
+
+    void print(llvm::StringRef OldProfile, llvm::StringRef NewProfile,
+               llvm::raw_ostream &OS);
+};
+}
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef PROFILEMERGER_H
+#define PROFILEMERGER_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <string>
+
+namespace epp {
+
+/// A profile to merge, the frequencies of which are multiplied by Weight.
+struct WeightedProfile {
+    std::string Filename;
+    uint64_t Weight = 1;
+};
+
+/// Merge profiles of the same program into one, in the format written by
+/// the runtime. The sections of a profile are sorted by function, so the
+/// profiles are read side by side in a k-way merge which holds the records
+/// of one section at a time. With more than one job, groups of profiles are
+/// first merged into temporary profiles in parallel. Profiles of different
+/// versions of a function are a fatal error. The merged profile ends with
+/// an index of its functions.
+void mergeProfiles(llvm::ArrayRef<WeightedProfile> Inputs,
+                   llvm::raw_ostream &OS, unsigned Jobs = 1);
+}
+
+#endif
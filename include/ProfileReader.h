@@ -0,0 +1,105 @@
+#ifndef PROFILEREADER_H
+#define PROFILEREADER_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace epp {
+
+/// The header line of a function table entry or of a section of the text
+/// profile.
+struct ProfileSection {
+    enum KindTy { FunctionEntry, Paths, LoopWindows };
+
+    KindTy Kind;
+    uint64_t GUID = 0;
+    /// Function table entries.
+    uint64_t NumPaths = 0;
+    uint64_t CFGHash  = 0;
+    llvm::StringRef Name;
+    /// Number of path records or loop windows which follow the header.
+    uint64_t NumRecords = 0;
+    /// Loop windows.
+    uint32_t LoopId = 0;
+    uint32_t K      = 0;
+};
+
+/// A line of the index at the end of a profile: where the table entry, the
+/// path section and the loop sections of a function are, as byte offsets
+/// and lengths. A section which is missing has length 0.
+struct ProfileIndexEntry {
+    uint64_t GUID;
+    uint64_t EntryOffset;
+    uint64_t EntryLength;
+    uint64_t PathsOffset;
+    uint64_t PathsLength;
+    uint64_t LoopsOffset;
+    uint64_t LoopsLength;
+    llvm::StringRef Name;
+};
+
+/// Reads a text profile written by the runtime. The file is mapped in
+/// memory and scanned in place; names point into the mapped file and stay
+/// valid as long as the reader. Malformed input is a fatal error naming
+/// the file and line.
+///
+///   while (Reader.next(S))
+///       for (uint64_t I = 0; I < S.NumRecords; I++)
+///           Reader.readPath(Id, Freq);
+///
+/// The sections end at the index, if the profile has one.
+class ProfileReader {
+    std::unique_ptr<llvm::MemoryBuffer> Buffer;
+    std::string Filename;
+    const char *Cur;
+    const char *End;
+    // 0 once the reader has moved to a range, errors then give the offset.
+    unsigned LineNo = 1;
+    // Byte ranges still to read after the current one.
+    std::vector<std::pair<uint64_t, uint64_t>> Ranges;
+
+    ProfileReader(std::unique_ptr<llvm::MemoryBuffer> B, llvm::StringRef F);
+
+    [[noreturn]] void error(const llvm::Twine &Msg) const;
+    void skipSpaces();
+    bool consume(llvm::StringRef Token);
+    uint64_t readHex();
+    uint64_t readDecimal();
+    llvm::StringRef readRestOfLine();
+    void endLine();
+
+  public:
+    /// Open a profile, a fatal error if it cannot be read.
+    static std::unique_ptr<ProfileReader> open(llvm::StringRef Filename);
+
+    /// Read the next header line. Returns false at the end of the file.
+    bool next(ProfileSection &S);
+    /// Read one record of a Paths section.
+    void readPath(uint64_t &PathId, uint64_t &Freq);
+    /// Read one window of a LoopWindows section, K path ids.
+    void readWindow(llvm::MutableArrayRef<uint64_t> PathIds, uint64_t &Freq);
+    /// Skip the records of a section.
+    void skipRecords(uint64_t NumRecords);
+
+    /// Read the index of the profile, sorted by GUID. Returns false if the
+    /// profile has none.
+    bool readIndex(std::vector<ProfileIndexEntry> &Index);
+    /// Only read the given byte ranges of the profile from now on, which
+    /// must each hold whole sections.
+    void restrict(llvm::ArrayRef<std::pair<uint64_t, uint64_t>> ByteRanges);
+};
+
+/// The GUIDs of the functions with paths in a profile, read from its index
+/// or its function table without reading the records.
+llvm::DenseSet<uint64_t> getProfiledFunctions(llvm::StringRef Filename);
+}
+
+#endif
@@ -4,9 +4,9 @@
 #include "llvm/ADT/SCCIterator.h"
 #include "llvm/ADT/SetVector.h"
 #include "llvm/Analysis/CFG.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
-#include <set>
 #include <vector>
 
 using namespace std;
@@ -14,73 +14,58 @@ using namespace epp;
 
 namespace {
 
-void postorderHelper(BasicBlock *toVisit, vector<BasicBlock *> &blocks,
-                     DenseSet<BasicBlock *> &seen,
-                     const set<BasicBlock *> &SCCBlocks) {
-    seen.insert(toVisit);
-    for (auto s = succ_begin(toVisit), e = succ_end(toVisit); s != e; ++s) {
-
-        // Don't need to worry about backedge successors as their targets
-        // will be visited already and will fail the first condition check.
-
-        if (!seen.count(*s) && (SCCBlocks.find(*s) != SCCBlocks.end())) {
-            postorderHelper(*s, blocks, seen, SCCBlocks);
-        }
-    }
-    blocks.push_back(toVisit);
-}
-
-vector<BasicBlock *> postOrder(BasicBlock *Block,
-                               const set<BasicBlock *> &SCCBlocks) {
-    vector<BasicBlock *> ordered;
-    DenseSet<BasicBlock *> seen;
-    postorderHelper(Block, ordered, seen, SCCBlocks);
-    return ordered;
-}
-
+/// Order the blocks of a function for numbering the paths: the strongly
+/// connected components in post order, and the blocks of each component
+/// in the post order of a DFS which starts at the first block of the
+/// component entered from a block not yet ordered.
+///
+/// Blocks are numbered by their position in the function and all the
+/// bookkeeping is kept in flat arrays indexed by that number. The DFS
+/// uses an explicit stack, so functions with very large CFGs neither
+/// overflow the stack nor take quadratic time.
 SmallVector<BasicBlock *, 32> postOrder(Function &F) {
     SmallVector<BasicBlock *, 32> PostOrderBlocks;
 
-    // Add all the basicblocks in the function to a set.
-    SetVector<BasicBlock *> BasicBlocks;
+    DenseMap<const BasicBlock *, uint32_t> Index;
     for (auto &BB : F)
-        BasicBlocks.insert(&BB);
+        Index.insert({&BB, Index.size()});
 
-    for (auto I = scc_begin(&F), IE = scc_end(&F); I != IE; ++I) {
+    // Ordered[I] is set once the component of block I has been ordered,
+    // SCCOf[I] is the number of the component of block I, 0 until the
+    // component is visited.
+    vector<bool> Ordered(Index.size(), false);
+    vector<uint32_t> SCCOf(Index.size(), 0);
+    uint32_t SCCNum = 0;
 
-        // Obtain the vector of BBs
-        const std::vector<BasicBlock *> &SCCBBs = *I;
+    SmallVector<pair<BasicBlock *, succ_iterator>, 32> Stack;
 
-        // Find an entry block into the current SCC as the starting point
-        // of the DFS for the postOrder traversal. Now the *entry* block
-        // should have predecessors in other SCC's which are topologically
-        // before this SCC, i.e blocks not seen yet.
+    for (auto I = scc_begin(&F), IE = scc_end(&F); I != IE; ++I) {
+        const std::vector<BasicBlock *> &SCCBBs = *I;
+        ++SCCNum;
 
-        // Remove each basic block which we encounter in the current SCC.
-        // Remaining blocks must be topologically earlier than the blocks
-        // we have seen already.
         DEBUG(errs() << "SCC: ");
         for (auto *BB : SCCBBs) {
             DEBUG(errs() << BB->getName() << " ");
-            BasicBlocks.remove(BB);
+            auto Id     = Index.lookup(BB);
+            Ordered[Id] = true;
+            SCCOf[Id]   = SCCNum;
         }
         DEBUG(errs() << "\n");
 
         // Find the first block in the current SCC to have a predecessor
-        // in the remaining blocks. This becomes the starting block for the DFS
-        // Exception: SCC size = 1. We rely on the fact that the ordering of
-        // predecessors is deterministic.
-
+        // in the blocks not ordered yet, these are topologically before
+        // the current SCC. This becomes the starting block for the DFS.
+        // Exception: SCC size = 1.
         BasicBlock *Start = nullptr;
-
-        for (int i = 0; i < SCCBBs.size() && Start == nullptr; i++) {
-            auto BB = SCCBBs[i];
+        for (auto *BB : SCCBBs) {
             for (auto P = pred_begin(BB), E = pred_end(BB); P != E; P++) {
-                if (BasicBlocks.count(*P)) {
+                if (!Ordered[Index.lookup(*P)]) {
                     Start = BB;
                     break;
                 }
             }
+            if (Start)
+                break;
         }
 
         if (!Start) {
@@ -89,15 +74,31 @@ SmallVector<BasicBlock *, 32> postOrder(Function &F) {
                    "Should be entry block only which has no preds");
         }
 
-        set<BasicBlock *> SCCBlocksSet(SCCBBs.begin(), SCCBBs.end());
-        auto blocks = postOrder(Start, SCCBlocksSet);
+        // DFS restricted to the current SCC. Visited blocks are marked by
+        // moving them out of the component, back edge successors have
+        // been visited already.
+        auto Size = PostOrderBlocks.size();
+        SCCOf[Index.lookup(Start)] = 0;
+        Stack.push_back({Start, succ_begin(Start)});
+        while (!Stack.empty()) {
+            auto *BB = Stack.back().first;
+            auto &S  = Stack.back().second;
+            if (S == succ_end(BB)) {
+                PostOrderBlocks.push_back(BB);
+                Stack.pop_back();
+                continue;
+            }
+            auto *Succ = *S++;
+            auto Id    = Index.lookup(Succ);
+            if (SCCOf[Id] == SCCNum) {
+                SCCOf[Id] = 0;
+                Stack.push_back({Succ, succ_begin(Succ)});
+            }
+        }
 
-        assert(SCCBBs.size() == blocks.size() &&
+        assert(SCCBBs.size() == PostOrderBlocks.size() - Size &&
                "Could not discover all blocks");
-
-        for (auto *BB : blocks) {
-            PostOrderBlocks.push_back(BB);
-        }
+        (void)Size;
     }
 
     DEBUG(errs() << "Post Order Blocks: \n");
@@ -109,186 +110,200 @@ SmallVector<BasicBlock *, 32> postOrder(Function &F) {
 }
 }
 
-// void AuxGraph::printWeights() {
-//     for (auto &V : Weights) {
-//         errs() << V.first->src->getName() << "-" << V.first->tgt->getName()
-//                << ": " << V.second << "\n";
-//     }
-// }
-
 /// Construct the auxiliary graph representation from the original
 /// function control flow graph. At this stage the CFG and the
 /// AuxGraph are the same graph.
 void AuxGraph::init(Function &F) {
     Nodes = postOrder(F);
-    SmallVector<BasicBlock *, 4> Leaves;
+
+    // Create a dummy basic block to represent the fake exit. It is left
+    // unnamed, naming a value updates state shared by the LLVMContext and
+    // functions may be encoded concurrently.
+    FakeExit = BasicBlock::Create(F.getContext());
+
+    // For each leaf (block with no successor in the original CFG), add
+    // an edge from it to the fake exit. So the only block with no successor
+    // is the fake exit block wrt to the AuxGraph.
+    vector<Edge> List;
     for (auto &BB : Nodes) {
         if (BB->getTerminator()->getNumSuccessors() > 0) {
             for (auto S = succ_begin(BB), E = succ_end(BB); S != E; S++) {
-                add(BB, *S);
+                List.emplace_back(BB, *S);
             }
         } else {
-            Leaves.push_back(BB);
+            List.emplace_back(BB, FakeExit, false);
         }
     }
 
-    // Create a dummy basic block to represent the fake exit
-    FakeExit = BasicBlock::Create(F.getContext(), "fake.exit");
-
-    // For each leaf (block with no successor in the original CFG), add
-    // an edge from it to the fake exit. So the only block with no successor
-    // is the fake exit block wrt to the AuxGraph.
-    for (auto &L : Leaves) {
-        add(L, FakeExit, false);
-    }
-
     Nodes.insert(Nodes.begin(), FakeExit);
+    for (uint32_t I = 0; I < Nodes.size(); I++)
+        NodeIds[Nodes[I]] = I;
 
-    /// Special case when there is only 1 basic block in the function
-    /// if (Nodes.size() == 1) {
-    ///     auto *src = Nodes.front();
-    ///     EdgeList.insert({src, SmallVector<EdgePtr, 4>()});
-    /// }
-}
-
-/// Add a new edge to the edge list. This method is only used for
-/// adding real edges by the constructor.
-EdgePtr AuxGraph::add(BasicBlock *src, BasicBlock *tgt, bool isReal) {
-    if (EdgeList.count(src) == 0) {
-        EdgeList.insert({src, SmallVector<EdgePtr, 4>()});
-    }
-    auto E = make_shared<Edge>(src, tgt, isReal);
-    EdgeList[src].push_back(E);
-    return E;
+    build(List);
 }
 
-EdgePtr AuxGraph::exists(BasicBlock *Src, BasicBlock *Tgt, bool isReal) const {
-    for (auto &SE : succs(Src)) {
-        if (SE->tgt == Tgt && SE->real == isReal) {
-            return SE;
-        }
+/// Rebuild the edge array from a list of edges. The edges are grouped by
+/// their source node with a counting sort, which keeps the order of the
+/// successors of each node. Returns the new id of each edge in the list.
+SmallVector<EdgeId, 32> AuxGraph::build(ArrayRef<Edge> List) {
+    Offsets.assign(Nodes.size() + 1, 0);
+    for (auto &E : List)
+        Offsets[NodeIds.lookup(E.src) + 1]++;
+    for (uint32_t I = 1; I < Offsets.size(); I++)
+        Offsets[I] += Offsets[I - 1];
+
+    SmallVector<uint32_t, 33> Next(Offsets.begin(), Offsets.end() - 1);
+    SmallVector<EdgeId, 32> Ids;
+    Edges.assign(List.size(), Edge(nullptr, nullptr));
+    for (auto &E : List) {
+        auto Id   = Next[NodeIds.lookup(E.src)]++;
+        Edges[Id] = E;
+        Ids.push_back(Id);
     }
-    return nullptr;
-}
-
-EdgePtr AuxGraph::getOrInsertEdge(BasicBlock *Src, BasicBlock *Tgt,
-                                  bool isReal) {
-    if (auto E = exists(Src, Tgt, isReal)) {
-        return E;
-    }
-    return add(Src, Tgt, isReal);
+    return Ids;
 }
 
 /// List of edges to be *segmented*. A segmented edge is an edge which
 /// exists in the original CFG but is replaced by two edges in the
 /// AuxGraph. An edge from A->B, is replaced by {A->Exit, Entry->B}.
-/// An edge can only be segmented once. This
+/// An edge can only be segmented once.
 void AuxGraph::segment(
     SetVector<pair<const BasicBlock *, const BasicBlock *>> &List) {
-    SmallVector<EdgePtr, 4> SegmentList;
-    /// Move the internal EdgePtr from the EdgeList to the SegmentList
+    /// Mark the segmented edges, they are dropped when the edge array is
+    /// rebuilt below.
+    vector<bool> Segmented(Edges.size(), false);
     for (auto &L : List) {
         auto *Src = L.first, *Tgt = L.second;
 
-        assert(EdgeList.count(Src) &&
+        assert(NodeIds.count(Src) &&
                "Source basicblock not found in edge list.");
-        auto &Edges = EdgeList[Src];
-        auto it     = find_if(Edges.begin(), Edges.end(),
-                          [&Tgt](EdgePtr &P) { return P->tgt == Tgt; });
-        assert(it != Edges.end() &&
+        auto Succs = succs(Src);
+        auto it    = find_if(Succs.begin(), Succs.end(),
+                          [&Tgt](const Edge &E) { return E.tgt == Tgt; });
+        assert(it != Succs.end() &&
                "Target basicblock not found in edge list.");
-        assert(SegmentMap.count(*it) == 0 &&
-               "An edge can only be segmented once.");
-        SegmentList.push_back(move(*it));
-        Edges.erase(it);
+        EdgeId Id = it - Edges.data();
+        assert(!Segmented[Id] && "An edge can only be segmented once.");
+        Segmented[Id] = true;
+        Segments.push_back({it->src, it->tgt, 0, 0});
     }
 
-    /// Add two new edges for each edge in the SegmentList. Update the EdgeList.
+    /// Add two new edges for each segmented edge after the remaining ones.
     /// An edge from A->B, is replaced by {A->Exit, Entry->B}.
-    auto &Entry = Nodes.back(), &Exit = Nodes.front();
-    for (auto &S : SegmentList) {
-        auto *A = S->src, *B = S->tgt;
-        // errs() << "Segmenting: " << A->getName() << "-" << B->getName() <<
-        // "\n";
-        auto AExit  = make_shared<Edge>(A, Exit, false);
-        auto EntryB = make_shared<Edge>(Entry, B, false);
-        // errs() << "Output: " << A->getName() << "-" << Exit->getName()
-        //<< "," << Entry->getName() << "-" << B->getName() << "\n";
-        EdgeList[A].push_back(AExit);
-        EdgeList[Entry].push_back(EntryB);
-        SegmentMap.insert({S, {AExit, EntryB}});
+    vector<Edge> NewEdges;
+    for (EdgeId I = 0; I < Edges.size(); I++) {
+        if (!Segmented[I])
+            NewEdges.push_back(Edges[I]);
+    }
+    auto First  = NewEdges.size();
+    auto *Entry = Nodes.back(), *Exit = Nodes.front();
+    for (auto &S : Segments) {
+        NewEdges.emplace_back(S.src, Exit, false);
+        NewEdges.emplace_back(Entry, S.tgt, false);
     }
-}
 
-/// Get all non-zero weights for non-segmented edges.
-SmallVector<pair<EdgePtr, APInt>, 16> AuxGraph::getWeights() const {
-    SmallVector<pair<EdgePtr, APInt>, 16> Result;
-    copy_if(Weights.begin(), Weights.end(), back_inserter(Result),
-            [](const pair<EdgePtr, APInt> &V) {
-                return V.first->real && V.second.ne(APInt(64, 0, true));
-            });
-    return Result;
+    auto Ids = build(NewEdges);
+    for (uint32_t I = 0; I < Segments.size(); I++) {
+        Segments[I].AExit  = Ids[First + 2 * I];
+        Segments[I].EntryB = Ids[First + 2 * I + 1];
+    }
 }
 
-/// Get the segment mapping
-std::unordered_map<EdgePtr, std::pair<EdgePtr, EdgePtr>>
-AuxGraph::getSegmentMap() const {
-    return SegmentMap;
+/// Get all real edges with a non-zero weight.
+SmallVector<const Edge *, 16> AuxGraph::getWeights() const {
+    SmallVector<const Edge *, 16> Result;
+    for (auto &E : Edges) {
+        if (E.real && E.weight != 0)
+            Result.push_back(&E);
+    }
+    return Result;
 }
 
-/// Get weight for a specific edge.
-APInt AuxGraph::getEdgeWeight(const EdgePtr &Ptr) const {
-    return Weights.at(Ptr);
+/// Return the successors edges of a basicblock from the Auxiliary Graph.
+ArrayRef<Edge> AuxGraph::succs(const BasicBlock *B) const {
+    auto It = NodeIds.find(B);
+    if (It == NodeIds.end())
+        return None;
+    auto I = It->second;
+    return makeArrayRef(Edges).slice(Offsets[I], Offsets[I + 1] - Offsets[I]);
 }
 
-/// Return the successors edges of a basicblock from the Auxiliary Graph.
-SmallVector<EdgePtr, 4> AuxGraph::succs(BasicBlock *B) const {
-    return EdgeList.lookup(B);
+MutableArrayRef<Edge> AuxGraph::succs(const BasicBlock *B) {
+    auto It = NodeIds.find(B);
+    if (It == NodeIds.end())
+        return None;
+    auto I = It->second;
+    return MutableArrayRef<Edge>(Edges).slice(Offsets[I],
+                                              Offsets[I + 1] - Offsets[I]);
 }
 
 /// Print out the AuxGraph in Graphviz format. Defaults to printing to
 /// llvm::errs()
-void AuxGraph::dot(raw_ostream &os = errs()) const {
+void AuxGraph::dot(raw_ostream &os) const {
     os << "digraph \"AuxGraph\" {\n label=\"AuxGraph\";\n";
     for (auto &N : Nodes) {
-        os << "\tNode" << N << " [shape=record, label=\"" << N->getName().str()
-           << "\"];\n";
+        os << "\tNode" << N << " [shape=record, label=\""
+           << (isExitBlock(N) ? "fake.exit" : N->getName()) << "\"];\n";
     }
-    for (auto &EL : EdgeList) {
-        for (auto &L : EL.getSecond()) {
-            os << "\tNode" << EL.getFirst() << " -> Node" << L->tgt
-               << " [style=solid,";
-            if (!L->real)
-                os << "color=\"red\",";
-            // os << " label=\"" << Weights[L] << "\"];\n";
-            os << " label=\""
-               << "\"];\n";
-        }
+    for (auto &E : Edges) {
+        os << "\tNode" << E.src << " -> Node" << E.tgt << " [style=solid,";
+        if (!E.real)
+            os << "color=\"red\",";
+        os << " label=\""
+           << "\"];\n";
     }
     os << "}\n";
 }
 
 /// Print out the AuxGraph in Graphviz format. Defaults to printing to
 /// llvm::errs()
-void AuxGraph::dotW(raw_ostream &os = errs()) const {
+void AuxGraph::dotW(raw_ostream &os) const {
     os << "digraph \"AuxGraph\" {\n label=\"AuxGraph\";\n";
     for (auto &N : Nodes) {
-        os << "\tNode" << N << " [shape=record, label=\"" << N->getName().str()
-           << "\"];\n";
+        os << "\tNode" << N << " [shape=record, label=\""
+           << (isExitBlock(N) ? "fake.exit" : N->getName()) << "\"];\n";
     }
-    for (auto &EL : EdgeList) {
-        for (auto &L : EL.getSecond()) {
-            os << "\tNode" << EL.getFirst() << " -> Node" << L->tgt
-               << " [style=solid,";
-            if (!L->real)
-                os << "color=\"red\",";
-            os << " label=\"" << Weights.at(L) << "\"];\n";
-        }
+    for (auto &E : Edges) {
+        os << "\tNode" << E.src << " -> Node" << E.tgt << " [style=solid,";
+        if (!E.real)
+            os << "color=\"red\",";
+        os << " label=\"" << E.weight << "\"];\n";
     }
     os << "}\n";
 }
 
 /// Clear all internal state; to be called by the releaseMemory function
 void AuxGraph::clear() {
-    Nodes.clear(), EdgeList.clear(), SegmentMap.clear(), Weights.clear();
+    Nodes.clear(), NodeIds.clear(), Edges.clear(), Offsets.clear(),
+        Segments.clear();
+}
+
+/// Number the paths of the AuxGraph bottom up. Visiting the nodes in post
+/// order guarantees that the number of paths of all the successors of a
+/// node is known, since the segmented graph has no back edges.
+bool epp::numberPaths(AuxGraph &AG,
+                      DenseMap<BasicBlock *, uint64_t> &NumPaths) {
+    for (auto *B : AG.nodes()) {
+        uint64_t PathCount = 0;
+
+        auto Succs = AG.succs(B);
+        if (Succs.empty()) {
+            PathCount = 1;
+            assert(
+                AG.isExitBlock(B) &&
+                "The only block without a successor should be the fake exit");
+        } else {
+            for (auto &SE : Succs) {
+                SE.weight = PathCount;
+                uint64_t SuccCount = NumPaths.insert({SE.tgt, 0}).first->second;
+
+                // This is the only place we need to check for overflow.
+                if (__builtin_add_overflow(PathCount, SuccCount, &PathCount))
+                    return false;
+            }
+        }
+
+        NumPaths.insert({B, PathCount});
+    }
+    return true;
 }
@@ -1,5 +1,7 @@
 #define DEBUG_TYPE "epp_decode"
+#include "llvm/ADT/DenseSet.h"
 #include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/CallSite.h"
@@ -10,6 +12,7 @@
 #include "llvm/Support/raw_ostream.h"
 
 #include "EPPDecode.h"
+#include "ProfileReader.h"
 
 #include <fstream>
 #include <sstream>
@@ -28,72 +31,111 @@ namespace {
 }
 
 bool EPPDecode::doInitialization(Module &M) {
-    uint32_t Id = 0;
     for (auto &F : M) {
-        FunctionIdToPtr[Id++] = &F;
+        if (!F.isDeclaration())
+            FunctionIdToPtr[getFunctionGUID(F)] = &F;
     }
     return false;
 }
 
 bool EPPDecode::runOnModule(Module &M) { return false; }
 
-void EPPDecode::getPathInfo(uint32_t FunctionId, Path &Info) {
-    auto &F        = *FunctionIdToPtr[FunctionId];
-    EPPEncode &Enc = getAnalysis<EPPEncode>(F);
-    auto R         = decode(F, Info.Id, Enc);
-    Info.Type      = R.first;
-    Info.Blocks    = R.second;
+/// Return the cached encoding of a function, encoding it on first use.
+/// Under the legacy pass manager an on the fly analysis is recomputed
+/// on every request, so EPPEncode is only requested here.
+EPPDecode::DecodeCacheEntry *EPPDecode::getCacheEntry(uint64_t FunctionId) {
+    auto &Entry = DecodeCache[FunctionId];
+    if (Entry)
+        return Entry.get();
+
+    auto *F = FunctionIdToPtr.lookup(FunctionId);
+    if (!F)
+        return nullptr;
+
+    EPPEncode &Enc  = getAnalysis<EPPEncode>(*F);
+    Entry           = llvm::make_unique<DecodeCacheEntry>();
+    Entry->Encoding = FunctionEncoding::get(*F, Enc);
+    for (auto *N : Enc.AG.nodes())
+        Entry->Blocks.push_back(Enc.AG.isExitBlock(N) ? nullptr : N);
+    return Entry.get();
 }
 
-pair<PathType, vector<BasicBlock *>>
-EPPDecode::decode(Function &F, APInt pathID, EPPEncode &E) {
-    vector<BasicBlock *> Sequence;
-    auto *Position = &F.getEntryBlock();
+const FunctionEncoding *EPPDecode::getEncoding(uint64_t FunctionId) {
+    auto *Entry = getCacheEntry(FunctionId);
+    return Entry ? &Entry->Encoding : nullptr;
+}
 
-    auto &AG = E.AG;
+void EPPDecode::getPathInfo(uint64_t FunctionId, Path &Info) {
+    getPathInfo(FunctionId, MutableArrayRef<Path>(Info));
+}
 
-    DEBUG(errs() << "Decode Called On: " << pathID << "\n");
+/// Decode all the given paths of a function together, so that the common
+/// prefixes of the paths are decoded once.
+void EPPDecode::getPathInfo(uint64_t FunctionId, MutableArrayRef<Path> Paths) {
+    auto *Entry = getCacheEntry(FunctionId);
+    assert(Entry && "Unknown function");
+
+    vector<uint64_t> PathIds;
+    for (auto &P : Paths)
+        PathIds.push_back(P.Id);
+    auto Decoded = Entry->Encoding.decode(PathIds);
+
+    for (uint32_t I = 0; I < Paths.size(); I++) {
+        auto &P = Paths[I];
+        P.Type  = Decoded[I].Type;
+        P.Next  = Decoded[I].Next == FunctionEncoding::NoNode
+                     ? nullptr
+                     : Entry->Blocks[Decoded[I].Next];
+        P.Blocks.clear();
+        for (auto N : Decoded[I].Nodes)
+            P.Blocks.push_back(Entry->Blocks[N]);
+    }
+}
 
-    vector<EdgePtr> SelectedEdges;
-    while (true) {
-        Sequence.push_back(Position);
-        if (AG.isExitBlock(Position))
+void epp::decodeProfile(
+    EPPDecode &D, StringRef ProfileFilename,
+    function_ref<void(Function &, MutableArrayRef<Path>)> Callback) {
+    DenseSet<uint64_t> Stale;
+    auto Reader = ProfileReader::open(ProfileFilename);
+    ProfileSection Header;
+    while (Reader->next(Header)) {
+        auto *FE = D.getEncoding(Header.GUID);
+        switch (Header.Kind) {
+        case ProfileSection::FunctionEntry:
+            if (FE && (FE->NumPaths != Header.NumPaths ||
+                       FE->CFGHash != Header.CFGHash)) {
+                errs() << "# Skipping stale profile of function " << FE->Name
+                       << "\n";
+                Stale.insert(Header.GUID);
+            }
             break;
-        APInt Wt(64, 0, true);
-        EdgePtr Select = nullptr;
-        DEBUG(errs() << Position->getName() << " (\n");
-        for (auto &Edge : AG.succs(Position)) {
-            auto EWt = AG.getEdgeWeight(Edge);
-            if (EWt.uge(Wt) && EWt.ule(pathID)) {
-                DEBUG(errs()
-                      << "\t" << Edge->tgt->getName() << " [" << EWt << "]\n");
-                Select = Edge;
-                Wt     = EWt;
+        case ProfileSection::Paths: {
+            if (!FE || Stale.count(Header.GUID)) {
+                Reader->skipRecords(Header.NumRecords);
+                break;
+            }
+            vector<Path> Paths;
+            for (uint64_t I = 0; I < Header.NumRecords; I++) {
+                Path P;
+                Reader->readPath(P.Id, P.Freq);
+                if (P.Id >= FE->NumPaths) {
+                    errs() << "# Skipping invalid path " << utohexstr(P.Id)
+                           << " of function " << FE->Name << "\n";
+                    continue;
+                }
+                Paths.push_back(std::move(P));
             }
+            if (Paths.empty())
+                break;
+            D.getPathInfo(Header.GUID, Paths);
+            Callback(*D.FunctionIdToPtr.lookup(Header.GUID), Paths);
+            break;
+        }
+        case ProfileSection::LoopWindows:
+            Reader->skipRecords(Header.NumRecords);
+            break;
         }
-        DEBUG(errs() << " )\n\n\n");
-
-        SelectedEdges.push_back(Select);
-        Position = Select->tgt;
-        pathID -= Wt;
-    }
-
-    if (SelectedEdges.empty())
-        return {RIRO, Sequence};
-
-#define SET_BIT(n, x) (n |= 1ULL << x)
-    uint64_t Type = 0;
-    if (!SelectedEdges.front()->real) {
-        SET_BIT(Type, 0);
-    }
-    if (!SelectedEdges.back()->real) {
-        SET_BIT(Type, 1);
     }
-#undef SET_BIT
-
-    return {static_cast<PathType>(Type),
-            vector<BasicBlock *>(Sequence.begin() + bool(Type & 0x1),
-                                 Sequence.end() - bool(Type & 0x2))};
 }
 
 char EPPDecode::ID = 0;
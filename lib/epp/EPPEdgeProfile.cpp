@@ -0,0 +1,179 @@
+#define DEBUG_TYPE "epp_edgeprofile"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/DebugInfo.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/FileSystem.h"
+
+#include <map>
+
+#include "EPPEdgeProfile.h"
+
+using namespace llvm;
+using namespace epp;
+using namespace std;
+
+extern cl::opt<string> profile;
+extern cl::opt<string> annotatedFilename;
+extern cl::opt<string> sampleProfileFilename;
+
+/// Fold the paths of every function of the profile which matches its
+/// encoding.
+bool EPPEdgeProfile::runOnModule(Module &M) {
+    EPPDecode &D = getAnalysis<EPPDecode>();
+    decodeProfile(D, profile, [this](Function &F, MutableArrayRef<Path> Paths) {
+        fold(F, Paths);
+    });
+
+    if (!sampleProfileFilename.empty()) {
+        error_code EC;
+        raw_fd_ostream Out(sampleProfileFilename, EC, sys::fs::F_Text);
+        if (EC)
+            report_fatal_error("Could not open " + sampleProfileFilename +
+                               ": " + EC.message());
+        writeSampleProfile(M, Out);
+    }
+
+    if (annotatedFilename.empty())
+        return false;
+
+    for (auto &F : M) {
+        if (Profiled.count(&F))
+            setBranchWeights(F);
+    }
+    return true;
+}
+
+/// Every execution of a block is part of exactly one path, so a block is
+/// counted once per path it is on. Consecutive blocks of a path are joined
+/// by a CFG edge, and a path cut by a segmented edge A->B continues at B.
+void EPPEdgeProfile::fold(Function &F, ArrayRef<Path> Paths) {
+    Profiled.insert(&F);
+    for (auto &P : Paths) {
+        for (uint32_t I = 0; I < P.Blocks.size(); I++) {
+            BlockCounts[P.Blocks[I]] += P.Freq;
+            if (I > 0)
+                EdgeCounts[{P.Blocks[I - 1], P.Blocks[I]}] += P.Freq;
+        }
+        if (P.Next)
+            EdgeCounts[{P.Blocks.back(), P.Next}] += P.Freq;
+    }
+}
+
+/// Branch weights are 32 bit, larger counts are scaled down uniformly
+/// for each branch. An edge reached through several successors of a
+/// switch gets its count on the first one.
+void EPPEdgeProfile::setBranchWeights(Function &F) {
+    F.setEntryCount(BlockCounts.lookup(&F.getEntryBlock()));
+
+    MDBuilder MDB(F.getContext());
+    for (auto &BB : F) {
+        auto *T = BB.getTerminator();
+        if (T->getNumSuccessors() < 2 ||
+            !(isa<BranchInst>(T) || isa<SwitchInst>(T) ||
+              isa<IndirectBrInst>(T)))
+            continue;
+
+        SmallVector<uint64_t, 4> Counts;
+        DenseSet<const BasicBlock *> Seen;
+        uint64_t MaxCount = 0;
+        for (unsigned I = 0; I < T->getNumSuccessors(); I++) {
+            auto *Succ = T->getSuccessor(I);
+            Counts.push_back(Seen.insert(Succ).second
+                                 ? EdgeCounts.lookup({&BB, Succ})
+                                 : 0);
+            MaxCount = max(MaxCount, Counts.back());
+        }
+        if (MaxCount == 0)
+            continue;
+
+        uint64_t Scale = MaxCount / UINT32_MAX + 1;
+        SmallVector<uint32_t, 4> Weights;
+        for (auto Count : Counts)
+            Weights.push_back(Count / Scale);
+        T->setMetadata(LLVMContext::MD_prof, MDB.createBranchWeights(Weights));
+    }
+}
+
+/// Write the counts in the text format of sample profiles, which
+/// llvm-profdata reads. The count of a line is the largest count of the
+/// blocks with instructions on it, as lines are identified by their
+/// offset from the start of the function and their discriminator.
+/// Instructions inlined from other functions are left out.
+void EPPEdgeProfile::writeSampleProfile(Module &M, raw_ostream &OS) {
+    for (auto &F : M) {
+        auto *SP = F.getSubprogram();
+        if (!Profiled.count(&F) || !SP)
+            continue;
+
+        map<pair<unsigned, unsigned>, uint64_t> Lines;
+        for (auto &BB : F) {
+            auto Count = BlockCounts.lookup(&BB);
+            for (auto &I : BB) {
+                auto &Loc = I.getDebugLoc();
+                if (!Loc || Loc.getInlinedAt() || Loc.getLine() < SP->getLine())
+                    continue;
+                auto &LineCount = Lines[{Loc.getLine() - SP->getLine(),
+                                         Loc->getDiscriminator()}];
+                LineCount = max(LineCount, Count);
+            }
+        }
+
+        uint64_t Total = 0;
+        for (auto &L : Lines)
+            Total += L.second;
+        OS << F.getName() << ":" << Total << ":"
+           << BlockCounts.lookup(&F.getEntryBlock()) << "\n";
+        for (auto &L : Lines) {
+            OS << " " << L.first.first;
+            if (L.first.second)
+                OS << "." << L.first.second;
+            OS << ": " << L.second << "\n";
+        }
+    }
+}
+
+namespace {
+
+/// The block of the unprepared copy a successor stands for, skipping the
+/// blocks preparation inserted in front of it. These are not in VMap and
+/// fall through to the next block.
+BasicBlock *getOriginalBlock(const BasicBlock *BB, ValueToValueMapTy &VMap) {
+    while (BB && !VMap.count(BB))
+        BB = BB->getSingleSuccessor();
+    if (!BB)
+        return nullptr;
+    Value *Copy = VMap.lookup(BB);
+    return cast<BasicBlock>(Copy);
+}
+}
+
+void epp::copyBranchWeights(Module &Prepared, ValueToValueMapTy &VMap) {
+    for (auto &F : Prepared) {
+        auto *Count = F.getMetadata(LLVMContext::MD_prof);
+        if (F.isDeclaration() || !Count)
+            continue;
+        Value *CopyF = VMap.lookup(&F);
+        cast<Function>(CopyF)->setMetadata(LLVMContext::MD_prof, Count);
+
+        for (auto &BB : F) {
+            auto *T       = BB.getTerminator();
+            auto *Weights = T->getMetadata(LLVMContext::MD_prof);
+            Value *CopyT  = VMap.lookup(T);
+            if (!Weights || !CopyT)
+                continue;
+
+            auto *Original = cast<TerminatorInst>(CopyT);
+            bool Same = Original->getNumSuccessors() == T->getNumSuccessors();
+            for (unsigned I = 0; Same && I < T->getNumSuccessors(); I++)
+                Same = getOriginalBlock(T->getSuccessor(I), VMap) ==
+                       Original->getSuccessor(I);
+            if (Same)
+                Original->setMetadata(LLVMContext::MD_prof, Weights);
+        }
+    }
+}
+
+char EPPEdgeProfile::ID = 0;
@@ -1,19 +1,21 @@
 #define DEBUG_TYPE "epp_encode"
 #include "llvm/ADT/MapVector.h"
 #include "llvm/ADT/PostOrderIterator.h"
-#include "llvm/ADT/SCCIterator.h"
 #include "llvm/ADT/SetVector.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/Analysis/CFG.h"
 #include "llvm/Analysis/CFGPrinter.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/CFG.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/Pass.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Scalar.h"
 
@@ -23,7 +25,6 @@
 #include <algorithm>
 #include <cassert>
 #include <fstream>
-#include <set>
 #include <vector>
 
 using namespace llvm;
@@ -32,6 +33,17 @@ using namespace std;
 
 extern cl::opt<bool> dumpGraphs;
 
+/// Stable identifier of a function in the profile. Functions visible
+/// outside their module are identified by their mangled name alone, so a
+/// function gets the same id in every module and build. Local functions
+/// are qualified with their source file like GlobalValue::getGUID does,
+/// but without the directory so the id does not depend on the build tree.
+uint64_t epp::getFunctionGUID(const Function &F) {
+    auto FileName = sys::path::filename(F.getParent()->getSourceFileName());
+    return GlobalValue::getGUID(GlobalValue::getGlobalIdentifier(
+        F.getName(), F.getLinkage(), FileName));
+}
+
 bool EPPEncode::doInitialization(Module &m) { return false; }
 bool EPPEncode::doFinalization(Module &m) { return false; }
 
@@ -63,99 +75,21 @@ void EPPEncode::releaseMemory() {
     LI = nullptr;
     numPaths.clear();
     AG.clear();
+    InnermostLoops.clear();
+    OwnedLI.reset();
+    CFGHash = 0;
 }
 
-void postorderHelper(BasicBlock *toVisit, vector<BasicBlock *> &blocks,
-                     DenseSet<BasicBlock *> &seen,
-                     const set<BasicBlock *> &SCCBlocks) {
-    seen.insert(toVisit);
-    for (auto s = succ_begin(toVisit), e = succ_end(toVisit); s != e; ++s) {
-
-        // Don't need to worry about backedge successors as their targets
-        // will be visited already and will fail the first condition check.
-
-        if (!seen.count(*s) && (SCCBlocks.find(*s) != SCCBlocks.end())) {
-            postorderHelper(*s, blocks, seen, SCCBlocks);
-        }
-    }
-    blocks.push_back(toVisit);
-}
-
-vector<BasicBlock *> postOrder(BasicBlock *Block,
-                               const set<BasicBlock *> &SCCBlocks) {
-    vector<BasicBlock *> ordered;
-    DenseSet<BasicBlock *> seen;
-    postorderHelper(Block, ordered, seen, SCCBlocks);
-    return ordered;
-}
-
-vector<BasicBlock *> postOrder(Function &F) {
-    vector<BasicBlock *> PostOrderBlocks;
-
-    // Add all the basicblocks in the function to a set.
-    SetVector<BasicBlock *> BasicBlocks;
-    for (auto &BB : F)
-        BasicBlocks.insert(&BB);
-
-    for (auto I = scc_begin(&F), IE = scc_end(&F); I != IE; ++I) {
-
-        // Obtain the vector of BBs
-        const std::vector<BasicBlock *> &SCCBBs = *I;
-
-        // Find an entry block into the current SCC as the starting point
-        // of the DFS for the postOrder traversal. Now the *entry* block
-        // should have predecessors in other SCC's which are topologically
-        // before this SCC, i.e blocks not seen yet.
-
-        // Remove each basic block which we encounter in the current SCC.
-        // Remaining blocks must be topologically earlier than the blocks
-        // we have seen already.
-        DEBUG(errs() << "SCC: ");
-        for (auto *BB : SCCBBs) {
-            DEBUG(errs() << BB->getName() << " ");
-            BasicBlocks.remove(BB);
-        }
-        DEBUG(errs() << "\n");
-
-        // Find the first block in the current SCC to have a predecessor
-        // in the remaining blocks. This becomes the starting block for the DFS
-        // Exception: SCC size = 1.
-
-        BasicBlock *Start = nullptr;
-
-        for (int i = 0; i < SCCBBs.size() && Start == nullptr; i++) {
-            auto BB = SCCBBs[i];
-            for (auto P = pred_begin(BB), E = pred_end(BB); P != E; P++) {
-                if (BasicBlocks.count(*P)) {
-                    Start = BB;
-                    break;
-                }
-            }
-        }
-
-        if (!Start) {
-            Start = SCCBBs[0];
-            assert(SCCBBs.size() == 1 &&
-                   "Should be entry block only which has no preds");
-        }
-
-        set<BasicBlock *> SCCBlocksSet(SCCBBs.begin(), SCCBBs.end());
-        auto blocks = postOrder(Start, SCCBlocksSet);
-
-        assert(SCCBBs.size() == blocks.size() &&
-               "Could not discover all blocks");
-
-        for (auto *BB : blocks) {
-            PostOrderBlocks.push_back(BB);
-        }
-    }
-
-    DEBUG(errs() << "Post Order Blocks: \n");
-    for (auto &POB : PostOrderBlocks)
-        DEBUG(errs() << POB->getName() << " ");
-    DEBUG(errs() << "\n");
-
-    return PostOrderBlocks;
+/// Compute the encoding of a function outside of the pass manager. This
+/// only reads the IR of the function, so encodings of different functions
+/// can be computed concurrently as long as the module is not modified.
+unique_ptr<EPPEncode> EPPEncode::compute(Function &F) {
+    auto Enc = llvm::make_unique<EPPEncode>();
+    DominatorTree DT(F);
+    Enc->OwnedLI = llvm::make_unique<LoopInfo>(DT);
+    Enc->LI      = Enc->OwnedLI.get();
+    Enc->encode(F);
+    return Enc;
 }
 
 DenseSet<pair<const BasicBlock *, const BasicBlock *>>
@@ -171,10 +105,62 @@ getBackEdges(BasicBlock *StartBB) {
     return BackEdges;
 }
 
+namespace {
+
+/// Structural hash of the CFG: the successors of every block, identified
+/// by their position in the function.
+uint64_t hashCFG(Function &F) {
+    DenseMap<const BasicBlock *, uint32_t> Index;
+    uint32_t Id = 0;
+    for (auto &BB : F)
+        Index[&BB] = Id++;
+
+    string Buffer;
+    raw_string_ostream OS(Buffer);
+    for (auto &BB : F) {
+        OS << Index[&BB] << ":";
+        for (auto S = succ_begin(&BB), E = succ_end(&BB); S != E; S++)
+            OS << Index[*S] << ",";
+        OS << ";";
+    }
+    return MD5Hash(OS.str());
+}
+
+void collectInnermostLoops(Loop *L, SmallVectorImpl<Loop *> &Loops) {
+    if (L->empty()) {
+        Loops.push_back(L);
+        return;
+    }
+    for (auto *SL : *L)
+        collectInnermostLoops(SL, Loops);
+}
+}
+
+/// Return the innermost loop for which Src->Tgt is a back edge, or
+/// nullptr if the edge is not a back edge of an innermost loop.
+Loop *EPPEncode::getBackEdgeLoop(BasicBlock *Src, BasicBlock *Tgt) const {
+    auto *L = LI->getLoopFor(Tgt);
+    if (!L || L->getHeader() != Tgt || !L->contains(Src) || !L->empty())
+        return nullptr;
+    return L;
+}
+
+/// Return the id of an innermost loop, or -1 if it is not one.
+int EPPEncode::getLoopId(const Loop *L) const {
+    auto It = find(InnermostLoops.begin(), InnermostLoops.end(), L);
+    if (It == InnermostLoops.end())
+        return -1;
+    return distance(InnermostLoops.begin(), It);
+}
+
 void EPPEncode::encode(Function &F) {
     DEBUG(errs() << "Called Encode on " << F.getName() << "\n");
 
     AG.init(F);
+    CFGHash = hashCFG(F);
+
+    for (auto *L : *LI)
+        collectInnermostLoops(L, InnermostLoops);
 
     auto *Entry    = &F.getEntryBlock();
     auto BackEdges = getBackEdges(Entry);
@@ -200,41 +186,15 @@ void EPPEncode::encode(Function &F) {
         dumpDotGraph("auxgraph-2.dot", AG);
     }
 
-    for (auto &B : AG.nodes()) {
-        APInt pathCount(64, 0, true);
-
-        auto Succs = AG.succs(B);
-        if (Succs.empty()) {
-            pathCount = 1;
-            assert(
-                B->getName().startswith("fake.exit") &&
-                "The only block without a successor should be the fake exit");
-        } else {
-            for (auto &SE : Succs) {
-                AG[SE]  = pathCount;
-                auto *S = SE->tgt;
-                if (numPaths.count(S) == 0)
-                    numPaths.insert(make_pair(S, APInt(64, 0, true)));
-
-                // This is the only place we need to check for overflow.
-                // If there is an overflow, indicate this by saving 0 as the
-                // number of paths from the entry block. This is impossible for
-                // a regular CFG where the numpaths from entry would atleast be
-                // 1
-                // if the entry block is also the exit block.
-                bool Ov   = false;
-                pathCount = pathCount.sadd_ov(numPaths[S], Ov);
-                if (Ov) {
-                    numPaths.clear();
-                    numPaths.insert(make_pair(Entry, APInt(64, 0, true)));
-                    DEBUG(errs()
-                          << "Integer Overflow in function " << F.getName());
-                    return;
-                }
-            }
-        }
-
-        numPaths.insert({B, pathCount});
+    // If there is an overflow, indicate this by saving 0 as the number of
+    // paths from the entry block. This is impossible for a regular CFG
+    // where the numpaths from entry would atleast be 1 if the entry block
+    // is also the exit block.
+    if (!numberPaths(AG, numPaths)) {
+        numPaths.clear();
+        numPaths.insert({Entry, 0});
+        DEBUG(errs() << "Integer Overflow in function " << F.getName());
+        return;
     }
 
     if (dumpGraphs) {
@@ -0,0 +1,101 @@
+#define DEBUG_TYPE "epp_outline"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/DebugInfo.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/CodeExtractor.h"
+
+#include "EPPOutline.h"
+#include "EPPSuperblock.h"
+
+using namespace llvm;
+using namespace epp;
+using namespace std;
+
+extern cl::opt<string> profile;
+extern cl::opt<unsigned> outlinePaths;
+extern cl::opt<unsigned> outlineMinSize;
+
+bool EPPOutline::runOnModule(Module &M) {
+    EPPDecode &D = getAnalysis<EPPDecode>();
+    auto Traces  = getHotTraces(D, profile, outlinePaths);
+    for (auto &F : M) {
+        auto It = Traces.find(&F);
+        if (It != Traces.end())
+            outlineTraces(F, It->second);
+    }
+
+    errs() << "# Outlined " << NumOutlined << " paths\n";
+    return NumOutlined > 0;
+}
+
+/// The allocas of the entry block stay in the function, so a path from the
+/// entry starts after them. An edge from the path back to its head becomes
+/// an exit, the outlined function runs the path once and the loop around it
+/// stays in the original function. The outlined function is named after the
+/// original one and the rank of the path, and has no debug information as
+/// it has no subprogram of its own. Paths shorter than -outline-min-size
+/// instructions are not worth the call and stay where they are.
+void EPPOutline::outlineTraces(Function &F,
+                               ArrayRef<vector<BasicBlock *>> Traces) {
+    SmallPtrSet<BasicBlock *, 16> Used;
+    unsigned Rank = 0;
+    for (auto Trace : Traces) {
+        Rank++;
+        if (!isTraceAvailable(Trace, Used))
+            continue;
+
+        unsigned Size = 0;
+        for (auto *BB : Trace)
+            Size += BB->size();
+        if (Size < outlineMinSize)
+            continue;
+
+        bool SplitEntry = Trace[0] == &F.getEntryBlock();
+        if (SplitEntry) {
+            auto It = Trace[0]->begin();
+            while (isa<AllocaInst>(It))
+                ++It;
+            Trace[0] = SplitBlock(Trace[0], &*It);
+        }
+        if (!all_of(Trace, [](BasicBlock *BB) {
+                return CodeExtractor::isBlockValidForExtraction(*BB);
+            })) {
+            // Leave the function as it was, so that the blocks of the
+            // trace stay available to colder ones.
+            if (SplitEntry)
+                MergeBlockIntoPredecessor(Trace[0]);
+            continue;
+        }
+        Used.insert(Trace.begin(), Trace.end());
+
+        SmallVector<BasicBlock *, 8> Region;
+        formSuperblock(Trace, UINT_MAX, &Region);
+        if (Region.size() < 2)
+            continue;
+
+        auto *Head = Region[0];
+        for (auto *BB : Region) {
+            while (find(succ_begin(BB), succ_end(BB), Head) != succ_end(BB))
+                SplitEdge(BB, Head);
+        }
+
+        CodeExtractor CE(Region);
+        if (!CE.isEligible())
+            continue;
+        auto *Outlined = CE.extractCodeRegion();
+        if (!Outlined)
+            continue;
+
+        Outlined->setName(F.getName() + ".epp.path" + Twine(Rank));
+        stripDebugInfo(*Outlined);
+        DEBUG(errs() << "Outlined " << Outlined->getName() << "\n");
+        NumOutlined++;
+    }
+}
+
+char EPPOutline::ID = 0;
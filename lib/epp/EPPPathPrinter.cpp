@@ -1,5 +1,6 @@
 #define DEBUG_TYPE "epp_pathprinter"
 #include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/CallSite.h"
@@ -7,10 +8,12 @@
 #include "llvm/IR/DebugInfo.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Support/raw_ostream.h"
 
-#include <fstream>
-#include <sstream>
 
 #include "EPPDecode.h"
 #include "EPPPathPrinter.h"
@@ -20,104 +23,621 @@ using namespace epp;
 using namespace std;
 
 extern cl::opt<string> profile;
+extern cl::opt<unsigned> numJobs;
+extern cl::opt<unsigned> topPaths;
+extern cl::opt<double> coverage;
+extern cl::opt<OutputFormat> outputFormat;
+extern cl::opt<string> decodeOutput;
 
-bool EPPPathPrinter::doInitialization(Module &M) {
-    uint32_t Id = 0;
-    for (auto &F : M) {
-        FunctionIdToPtr[Id++] = &F;
+/// A decoded path, with the frequency of its window for loop paths.
+struct epp::DecodedPath {
+    uint64_t Id;
+    uint64_t Freq;
+    PathType Type;
+    vector<uint32_t> Nodes;
+};
+
+/// Writes the decoded sections in one output format. The sections are
+/// written to separate streams concurrently, so writers have no state.
+class epp::PathWriter {
+  public:
+    virtual ~PathWriter() {}
+    virtual void begin(raw_ostream &OS) {}
+    /// Called before the first loop section.
+    virtual void beginLoops(raw_ostream &OS) {}
+    /// Called between two sections.
+    virtual void separator(raw_ostream &OS) {}
+    virtual void end(raw_ostream &OS) {}
+    virtual void function(raw_ostream &OS, const ProfilePrinter::Section &S,
+                          ArrayRef<DecodedPath> Paths) = 0;
+    /// The paths of the printed windows, K paths per window.
+    virtual void loop(raw_ostream &OS, const ProfilePrinter::Section &S,
+                      ArrayRef<DecodedPath> Paths) = 0;
+    /// Whether the notes about skipped functions are part of the output,
+    /// otherwise they go to stderr.
+    virtual bool inlineNotes() const { return false; }
+};
+
+namespace {
+
+const char *PathTypeNames[] = {"RIRO", "FIRO", "RIFO", "FIFO"};
+
+/// Drop the least frequent records, keeping at most -top of them and only
+/// as many as needed to cover -coverage of the total frequency. Order
+/// holds the indices of the records from the most frequent one.
+void selectRecords(vector<uint32_t> &Order, ArrayRef<uint64_t> Freqs) {
+    if (topPaths > 0 && Order.size() > topPaths)
+        Order.resize(topPaths);
+
+    if (coverage < 1.0) {
+        long double Total = 0, Covered = 0;
+        for (auto Freq : Freqs)
+            Total += Freq;
+
+        uint32_t N = 0;
+        while (N < Order.size() && Covered < coverage * Total)
+            Covered += Freqs[Order[N++]];
+        Order.resize(N);
     }
-    return false;
 }
 
-void printPathSrc(vector<BasicBlock *> &blocks, raw_ostream &out,
-                  SmallString<8> prefix) {
-    unsigned line = 0;
-    llvm::StringRef file;
-    for (auto *bb : blocks) {
-        for (auto &instruction : *bb) {
-            MDNode *n = instruction.getMetadata("dbg");
-            if (!n) {
-                continue;
-            }
-            DebugLoc Loc(n);
-            if (Loc->getLine() != line || Loc->getFilename() != file) {
-                line = Loc->getLine();
-                file = Loc->getFilename();
-                out << prefix << "- " << file.str() << "," << line << "\n";
-            }
+/// Decode the paths at the given indices of a section.
+vector<DecodedPath> decodePaths(const ProfilePrinter::Section &S,
+                                ArrayRef<uint32_t> Indices) {
+    vector<uint64_t> PathIds;
+    for (auto I : Indices)
+        PathIds.push_back(S.PathIds[I]);
+    auto Decoded = S.FE->decode(PathIds);
+
+    vector<DecodedPath> Paths(Indices.size());
+    for (uint32_t I = 0; I < Indices.size(); I++) {
+        auto Freq = S.IsLoop ? S.Freqs[Indices[I] / S.K] : S.Freqs[Indices[I]];
+        Paths[I]  = {PathIds[I], Freq, Decoded[I].Type,
+                    std::move(Decoded[I].Nodes)};
+    }
+    return Paths;
+}
+
+/// The original human readable output.
+class YAMLPathWriter : public PathWriter {
+  public:
+    void begin(raw_ostream &OS) override { OS << "# Decoded Paths\n"; }
+    void beginLoops(raw_ostream &OS) override {
+        OS << "# Decoded Loop Paths\n";
+    }
+
+    void function(raw_ostream &OS, const ProfilePrinter::Section &S,
+                  ArrayRef<DecodedPath> Paths) override {
+        OS << "- name: " << S.FE->Name << "\n";
+        OS << "  num_exec_paths: " << S.PathIds.size() << "\n";
+        if (Paths.size() < S.PathIds.size())
+            OS << "  num_printed_paths: " << Paths.size() << "\n";
+
+        for (auto &P : Paths) {
+            OS << "  - path: " << utohexstr(P.Id) << "\n";
+            S.FE->printPathSrc(P.Nodes, OS, "      ");
+        }
+    }
+
+    void loop(raw_ostream &OS, const ProfilePrinter::Section &S,
+              ArrayRef<DecodedPath> Paths) override {
+        auto NumWindows = Paths.size() / S.K;
+        OS << "- name: " << S.FE->Name << "\n";
+        OS << "  loop: " << S.LoopId << "\n";
+        OS << "  header: " << S.FE->LoopHeaders[S.LoopId] << "\n";
+        OS << "  k: " << S.K << "\n";
+        OS << "  num_exec_windows: " << S.Freqs.size() << "\n";
+        if (NumWindows < S.Freqs.size())
+            OS << "  num_printed_windows: " << NumWindows << "\n";
+
+        for (uint32_t I = 0; I < Paths.size(); I++) {
+            if (I % S.K == 0)
+                OS << "  - window: " << Paths[I].Freq << "\n";
+            OS << "    - path: " << utohexstr(Paths[I].Id) << "\n";
+            S.FE->printPathSrc(Paths[I].Nodes, OS, "        ");
         }
     }
+
+    bool inlineNotes() const override { return true; }
+};
+
+void writeJSONString(raw_ostream &OS, StringRef Str) {
+    OS << '"';
+    for (unsigned char C : Str) {
+        if (C == '"' || C == '\\')
+            OS << '\\' << C;
+        else if (C < 0x20)
+            OS << "\\u" << format_hex_no_prefix(C, 4);
+        else
+            OS << C;
+    }
+    OS << '"';
 }
 
-bool EPPPathPrinter::runOnModule(Module &M) {
+/// A JSON array with one object per function or loop section:
+///
+///   {"kind": "function", "name": ..., "guid": ..., "num_exec_paths": ...,
+///    "paths": [<path>, ...]}
+///   {"kind": "loop", "name": ..., "guid": ..., "loop": ..., "header": ...,
+///    "k": ..., "num_exec_windows": ...,
+///    "windows": [{"freq": ..., "paths": [<path>, ...]}, ...]}
+///
+/// where a path is
+///
+///   {"id": <hex string>, "freq": ..., "type": "RIRO", "blocks": [...],
+///    "source": [{"file": ..., "line": ...}, ...]}
+class JSONPathWriter : public PathWriter {
+    static void path(raw_ostream &OS, const FunctionEncoding &FE,
+                     const DecodedPath &P) {
+        OS << "{\"id\": \"" << utohexstr(P.Id) << "\", \"freq\": " << P.Freq
+           << ", \"type\": \"" << PathTypeNames[P.Type] << "\", \"blocks\": [";
+        for (uint32_t I = 0; I < P.Nodes.size(); I++) {
+            OS << (I ? ", " : "");
+            writeJSONString(OS, FE.BlockNames[P.Nodes[I]]);
+        }
+        OS << "], \"source\": [";
 
-    EPPDecode &D = getAnalysis<EPPDecode>();
+        vector<FunctionEncoding::Location> Locs;
+        FE.getPathSrc(P.Nodes, Locs);
+        for (uint32_t I = 0; I < Locs.size(); I++) {
+            OS << (I ? ", " : "") << "{\"file\": ";
+            writeJSONString(OS, FE.Files[Locs[I].File]);
+            OS << ", \"line\": " << Locs[I].Line << "}";
+        }
+        OS << "]}";
+    }
+
+    static void header(raw_ostream &OS, StringRef Kind,
+                       const FunctionEncoding &FE) {
+        OS << "{\"kind\": \"" << Kind << "\", \"name\": ";
+        writeJSONString(OS, FE.Name);
+        OS << ", \"guid\": \"" << format_hex_no_prefix(FE.GUID, 16) << "\"";
+    }
+
+  public:
+    void begin(raw_ostream &OS) override { OS << "[\n"; }
+    void separator(raw_ostream &OS) override { OS << ",\n"; }
+    void end(raw_ostream &OS) override { OS << "\n]\n"; }
+
+    void function(raw_ostream &OS, const ProfilePrinter::Section &S,
+                  ArrayRef<DecodedPath> Paths) override {
+        header(OS, "function", *S.FE);
+        OS << ", \"num_exec_paths\": " << S.PathIds.size() << ", \"paths\": [";
+        for (uint32_t I = 0; I < Paths.size(); I++) {
+            OS << (I ? ",\n  " : "\n  ");
+            path(OS, *S.FE, Paths[I]);
+        }
+        OS << "]}";
+    }
+
+    void loop(raw_ostream &OS, const ProfilePrinter::Section &S,
+              ArrayRef<DecodedPath> Paths) override {
+        header(OS, "loop", *S.FE);
+        OS << ", \"loop\": " << S.LoopId << ", \"header\": ";
+        writeJSONString(OS, S.FE->LoopHeaders[S.LoopId]);
+        OS << ", \"k\": " << S.K << ", \"num_exec_windows\": " << S.Freqs.size()
+           << ", \"windows\": [";
+        for (uint32_t I = 0; I < Paths.size(); I++) {
+            if (I % S.K == 0)
+                OS << (I ? "]},\n  " : "\n  ") << "{\"freq\": " << Paths[I].Freq
+                   << ", \"paths\": [";
+            else
+                OS << ", ";
+            path(OS, *S.FE, Paths[I]);
+        }
+        OS << (Paths.empty() ? "]}" : "]}]}");
+    }
+};
+
+/// Little endian records, strings are a 32 bit length and the bytes:
+///
+///   file:     "EPPD" <u32 version> {section} <u8 0>
+///   section:  <u8 kind, 1 function or 2 loop> <u64 guid> <str name>
+///             [<u32 loop id> <str header> <u32 k>]  (loops)
+///             <u64 executed records>
+///             <u32 blocks> {<str block name>} <u32 files> {<str file>}
+///             <u64 records> {<u64 freq> <path>}     (functions)
+///             <u64 records> {<u64 freq> k*<path>}   (loops)
+///   path:     <u64 id> <u8 path type> <u32 blocks> {<u32 block>}
+///             <u32 lines> {<u32 file> <u32 line>}
+///
+/// Blocks and files of the paths are indices into the tables of the
+/// section.
+class BinaryPathWriter : public PathWriter {
+    typedef support::endian::Writer<support::little> Writer;
+
+    static void str(Writer &W, StringRef Str) {
+        W.write<uint32_t>(Str.size());
+        W.OS << Str;
+    }
+
+    static void path(Writer &W, const FunctionEncoding &FE,
+                     const DecodedPath &P) {
+        W.write<uint64_t>(P.Id);
+        W.write<uint8_t>(P.Type);
+        W.write<uint32_t>(P.Nodes.size());
+        for (auto N : P.Nodes)
+            W.write<uint32_t>(N);
+
+        vector<FunctionEncoding::Location> Locs;
+        FE.getPathSrc(P.Nodes, Locs);
+        W.write<uint32_t>(Locs.size());
+        for (auto &L : Locs) {
+            W.write<uint32_t>(L.File);
+            W.write<uint32_t>(L.Line);
+        }
+    }
+
+    static void header(Writer &W, uint8_t Kind, const FunctionEncoding &FE) {
+        W.write<uint8_t>(Kind);
+        W.write<uint64_t>(FE.GUID);
+        str(W, FE.Name);
+    }
+
+    static void tables(Writer &W, const FunctionEncoding &FE) {
+        W.write<uint32_t>(FE.BlockNames.size());
+        for (auto &Name : FE.BlockNames)
+            str(W, Name);
+        W.write<uint32_t>(FE.Files.size());
+        for (auto &File : FE.Files)
+            str(W, File);
+    }
+
+  public:
+    void begin(raw_ostream &OS) override {
+        Writer W(OS);
+        OS << "EPPD";
+        W.write<uint32_t>(1);
+    }
+    void end(raw_ostream &OS) override { Writer(OS).write<uint8_t>(0); }
+
+    void function(raw_ostream &OS, const ProfilePrinter::Section &S,
+                  ArrayRef<DecodedPath> Paths) override {
+        Writer W(OS);
+        header(W, 1, *S.FE);
+        W.write<uint64_t>(S.PathIds.size());
+        tables(W, *S.FE);
+        W.write<uint64_t>(Paths.size());
+        for (auto &P : Paths) {
+            W.write<uint64_t>(P.Freq);
+            path(W, *S.FE, P);
+        }
+    }
+
+    void loop(raw_ostream &OS, const ProfilePrinter::Section &S,
+              ArrayRef<DecodedPath> Paths) override {
+        Writer W(OS);
+        header(W, 2, *S.FE);
+        W.write<uint32_t>(S.LoopId);
+        str(W, S.FE->LoopHeaders[S.LoopId]);
+        W.write<uint32_t>(S.K);
+        W.write<uint64_t>(S.Freqs.size());
+        tables(W, *S.FE);
+        W.write<uint64_t>(Paths.size() / S.K);
+        for (uint32_t I = 0; I < Paths.size(); I++) {
+            if (I % S.K == 0)
+                W.write<uint64_t>(Paths[I].Freq);
+            path(W, *S.FE, Paths[I]);
+        }
+    }
+};
+
+void printFunctionPaths(const ProfilePrinter::Section &S, PathWriter &Writer,
+                        raw_ostream &OS) {
+    // Sort the paths in descending order of their frequency
+    // If the frequency is same, descending order of id (id cannot be
+    // same)
+    vector<uint32_t> Order(S.PathIds.size());
+    for (uint32_t I = 0; I < Order.size(); I++)
+        Order[I] = I;
+    sort(Order.begin(), Order.end(), [&S](uint32_t I1, uint32_t I2) {
+        return (S.Freqs[I1] > S.Freqs[I2]) ||
+               (S.Freqs[I1] == S.Freqs[I2] && S.PathIds[I1] > S.PathIds[I2]);
+    });
+
+    // Only the selected paths are decoded.
+    selectRecords(Order, S.Freqs);
+    Writer.function(OS, S, decodePaths(S, Order));
+}
+
+/// Each window is a sequence of K consecutive iteration paths of an
+/// innermost loop.
+void printLoopPaths(const ProfilePrinter::Section &S, PathWriter &Writer,
+                    raw_ostream &OS) {
+    assert(S.LoopId < S.FE->LoopHeaders.size() && "Invalid loop id");
+
+    // Select the most frequent windows, then print them in profile order.
+    vector<uint32_t> Order(S.Freqs.size());
+    for (uint32_t I = 0; I < Order.size(); I++)
+        Order[I] = I;
+    stable_sort(Order.begin(), Order.end(), [&S](uint32_t I1, uint32_t I2) {
+        return S.Freqs[I1] > S.Freqs[I2];
+    });
+    selectRecords(Order, S.Freqs);
+    sort(Order.begin(), Order.end());
+
+    // Decode the paths of all the windows together, they share prefixes.
+    vector<uint32_t> Indices;
+    for (auto I : Order)
+        for (uint32_t J = 0; J < S.K; J++)
+            Indices.push_back(I * S.K + J);
+    Writer.loop(OS, S, decodePaths(S, Indices));
+}
+
+void decodeSection(ProfilePrinter::Section &S, PathWriter &Writer) {
+    if (!S.FE)
+        return;
+    raw_string_ostream OS(S.Output);
+    if (S.IsLoop)
+        printLoopPaths(S, Writer, OS);
+    else
+        printFunctionPaths(S, Writer, OS);
+}
+}
+
+ProfilePrinter::ProfilePrinter(LookupTy L, unsigned Jobs, OutputFormat Format)
+    : Lookup(std::move(L)), Jobs(Jobs) {
+    switch (Format) {
+    case YAMLFormat:
+        Writer = llvm::make_unique<YAMLPathWriter>();
+        break;
+    case JSONFormat:
+        Writer = llvm::make_unique<JSONPathWriter>();
+        break;
+    case BinaryFormat:
+        Writer = llvm::make_unique<BinaryPathWriter>();
+        break;
+    }
+}
+
+ProfilePrinter::~ProfilePrinter() {}
+
+/// Check a function table entry of the profile against the encoding. The
+/// number of paths and the CFG hash of the function must match what it
+/// was instrumented with, otherwise the path ids cannot be decoded.
+void ProfilePrinter::checkFunction(const ProfileSection &Entry) {
+    auto *FE = Lookup(Entry.GUID);
+    if (!FE)
+        return;
+
+    if (FE->NumPaths != Entry.NumPaths || FE->CFGHash != Entry.CFGHash) {
+        *Notes << "# Skipping stale profile of function " << FE->Name << "\n";
+        StaleFunctions.insert(Entry.GUID);
+    }
+}
 
-    ifstream InFile(profile.c_str(), ios::in);
-    assert(InFile.is_open() && "Could not open file for reading");
+/// Notes are kept in the order of the sections when they are part of the
+/// output.
+void ProfilePrinter::note(Section &S, const Twine &Note) {
+    if (Writer->inlineNotes())
+        S.Output += Note.str();
+    else
+        errs() << Note;
+}
 
-    errs() << "# Decoded Paths\n";
+/// Look up the encoding of the function of a section. Sections of stale
+/// functions are dropped, and sections of functions which are not part of
+/// the module only print a note, for instance when the profile was merged
+/// from several modules. Returns false if the records are to be skipped.
+bool ProfilePrinter::lookupSection(uint64_t FunctionId, Section &S) {
+    if (StaleFunctions.count(FunctionId))
+        return false;
 
-    try {
-        string Line;
-        while (getline(InFile, Line)) {
-            uint64_t FunctionId = 0, NumberOfPaths = 0;
-            stringstream SS(Line);
-            SS >> FunctionId >> NumberOfPaths;
+    S.FE = Lookup(FunctionId);
+    if (!S.FE) {
+        string Note;
+        raw_string_ostream(Note) << "# Skipping unknown function "
+                                 << format_hex(FunctionId, 18) << "\n";
+        note(S, Note);
+        return false;
+    }
+    return true;
+}
 
-            // If no paths have been executed for this function,
-            // then skip it altogether. A continue over here is fine,
-            // since there are no lines for the paths themselves and
-            // the next line we expect is for one FunctionId and NumberOfPaths.
+/// Read the path records of a function section.
+void ProfilePrinter::readFunctionSection(const ProfileSection &Header,
+                                         ProfileReader &Reader, Section &S) {
+    if (!lookupSection(Header.GUID, S)) {
+        Reader.skipRecords(Header.NumRecords);
+        return;
+    }
 
-            if (NumberOfPaths == 0)
+    // A path id out of the range of the function cannot be decoded, the
+    // record is reported and dropped.
+    for (uint64_t I = 0; I < Header.NumRecords; I++) {
+        uint64_t Id, Freq;
+        Reader.readPath(Id, Freq);
+        if (Id >= S.FE->NumPaths) {
+            note(S, "# Skipping invalid path " + utohexstr(Id) +
+                        " of function " + S.FE->Name + "\n");
+            continue;
+        }
+        S.PathIds.push_back(Id);
+        S.Freqs.push_back(Freq);
+    }
+    if (S.PathIds.empty())
+        S.FE = nullptr;
+}
+
+/// Read the windows of a loop section.
+void ProfilePrinter::readLoopSection(const ProfileSection &Header,
+                                     ProfileReader &Reader, Section &S) {
+    S.IsLoop = true;
+    S.LoopId = Header.LoopId;
+    S.K      = Header.K;
+
+    if (!lookupSection(Header.GUID, S)) {
+        Reader.skipRecords(Header.NumRecords);
+        return;
+    }
+
+    // A window with a path id out of range is dropped as a whole.
+    vector<uint64_t> Window(S.K);
+    for (uint64_t I = 0; I < Header.NumRecords; I++) {
+        uint64_t Freq;
+        Reader.readWindow(Window, Freq);
+        auto Invalid = find_if(Window.begin(), Window.end(), [&S](uint64_t Id) {
+            return Id >= S.FE->NumPaths;
+        });
+        if (Invalid != Window.end()) {
+            note(S, "# Skipping invalid path " + utohexstr(*Invalid) +
+                        " of function " + S.FE->Name + "\n");
+            continue;
+        }
+        S.PathIds.insert(S.PathIds.end(), Window.begin(), Window.end());
+        S.Freqs.push_back(Freq);
+    }
+    if (S.Freqs.empty())
+        S.FE = nullptr;
+}
+
+/// The profile is read in full first, looking up the encoding of each
+/// section. The encodings are only read afterwards, so the sections are
+/// decoded concurrently and then printed in the order of the profile.
+void ProfilePrinter::print(ProfileReader &Reader, raw_ostream &OS) {
+    Notes = Writer->inlineNotes() ? &OS : &errs();
+    Writer->begin(OS);
+
+    vector<Section> Sections;
+    ProfileSection Header;
+    while (Reader.next(Header)) {
+        switch (Header.Kind) {
+        // The function table precedes all the path records.
+        case ProfileSection::FunctionEntry:
+            checkFunction(Header);
+            continue;
+        // If no paths have been executed for this function, then skip it
+        // altogether, there are no lines for the paths themselves.
+        case ProfileSection::Paths:
+            if (Header.NumRecords == 0)
                 continue;
+            Sections.emplace_back();
+            readFunctionSection(Header, Reader, Sections.back());
+            break;
+        // Loop windows of the k-iteration mode are stored after all the
+        // path records.
+        case ProfileSection::LoopWindows:
+            Sections.emplace_back();
+            readLoopSection(Header, Reader, Sections.back());
+            break;
+        }
 
-            errs() << "- name: " << FunctionIdToPtr[FunctionId]->getName()
-                   << "\n";
-            errs() << "  num_exec_paths: " << NumberOfPaths << "\n";
-
-            vector<Path> Paths;
-            for (uint32_t I = 0; I < NumberOfPaths; I++) {
-                getline(InFile, Line);
-
-                stringstream SS(Line);
-                string PathIdStr;
-                uint64_t PathExecFreq;
-                SS >> PathIdStr >> PathExecFreq;
-                APInt PathId(64, StringRef(PathIdStr), 16);
-
-                // Add a path data struct for each path we find in the
-                // profile. For each struct only initialize the Id and
-                // Frequency fields.
-                Path P = {PathId, PathExecFreq};
-                D.getPathInfo(FunctionId, P);
-                Paths.push_back(P);
-            }
+        // Stale functions print nothing.
+        if (!Sections.back().FE && Sections.back().Output.empty())
+            Sections.pop_back();
+    }
+
+    if (Jobs > 1) {
+        ThreadPool Pool(Jobs);
+        for (auto &S : Sections)
+            Pool.async([this, &S]() { decodeSection(S, *Writer); });
+        Pool.wait();
+    } else {
+        for (auto &S : Sections)
+            decodeSection(S, *Writer);
+    }
 
-            // Sort the paths in descending order of their frequency
-            // If the frequency is same, descending order of id (id cannot be
-            // same)
-            sort(Paths.begin(), Paths.end(),
-                 [](const Path &P1, const Path &P2) {
-                     return (P1.Freq > P2.Freq) ||
-                            (P1.Freq == P2.Freq && P1.Id.uge(P2.Id));
-                 });
-
-            for (auto &P : Paths) {
-                SmallString<16> PathId;
-                P.Id.toStringSigned(PathId, 16);
-                errs() << "  - path: " << PathId << "\n";
-                printPathSrc(P.Blocks, errs(), StringRef("      "));
+    bool FirstRecord = true, PrintedLoopHeader = false;
+    for (auto &S : Sections) {
+        if (S.FE) {
+            if (S.IsLoop && !PrintedLoopHeader) {
+                Writer->beginLoops(OS);
+                PrintedLoopHeader = true;
             }
+            if (!FirstRecord)
+                Writer->separator(OS);
+            FirstRecord = false;
         }
-    } catch (...) {
-        report_fatal_error("Invalid profile format?");
+        OS << S.Output;
     }
+    Writer->end(OS);
+}
 
-    InFile.close();
+namespace {
+
+/// Print the decoded paths to -decode-output. By default the YAML output
+/// goes to stderr, as it always has, and the other formats to stdout.
+void printProfile(ProfileReader &Reader, ProfilePrinter::LookupTy Lookup) {
+    ProfilePrinter Printer(std::move(Lookup), numJobs, outputFormat);
+
+    if (decodeOutput.empty()) {
+        Printer.print(Reader, outputFormat == YAMLFormat ? errs() : outs());
+        return;
+    }
+
+    error_code EC;
+    raw_fd_ostream Out(decodeOutput, EC, outputFormat == BinaryFormat
+                                             ? sys::fs::F_None
+                                             : sys::fs::F_Text);
+    if (EC)
+        report_fatal_error("Could not open " + decodeOutput + ": " +
+                           EC.message());
+    Printer.print(Reader, Out);
+}
+
+ProfilePrinter::LookupTy lookupIn(const EncodingMap &Encodings) {
+    return [&Encodings](uint64_t FunctionId) -> const FunctionEncoding * {
+        auto It = Encodings.find(FunctionId);
+        return It == Encodings.end() ? nullptr : It->second.get();
+    };
+}
+}
+
+/// The encodings are computed from the module, once per function.
+bool EPPPathPrinter::runOnModule(Module &M) {
+
+    EPPDecode &D = getAnalysis<EPPDecode>();
+
+    auto Reader = ProfileReader::open(profile);
+    printProfile(*Reader, [&D](uint64_t FunctionId) {
+        return D.getEncoding(FunctionId);
+    });
 
     return false;
 }
 
+void epp::printProfileWithEncodingFile(StringRef ProfileFilename,
+                                       StringRef EncodingFilename) {
+    auto Encodings = readEncodingFile(EncodingFilename);
+    auto Reader    = ProfileReader::open(ProfileFilename);
+    printProfile(*Reader, lookupIn(Encodings));
+}
+
+/// The index is sorted by GUID and a name may belong to several local
+/// functions, so all its entries are searched. The ranges are read in
+/// the order of the profile, which keeps the table entries first.
+void epp::queryProfile(StringRef ProfileFilename, StringRef EncodingFilename,
+                       StringRef FunctionName) {
+    auto Reader = ProfileReader::open(ProfileFilename);
+    vector<ProfileIndexEntry> Index;
+    if (!Reader->readIndex(Index))
+        report_fatal_error("Profile " + ProfileFilename +
+                           " has no index, rewrite it with llvm-epp merge");
+
+    vector<pair<uint64_t, uint64_t>> Ranges;
+    DenseSet<uint64_t> GUIDs;
+    for (auto &E : Index) {
+        if (E.Name != FunctionName)
+            continue;
+        GUIDs.insert(E.GUID);
+        Ranges.push_back({E.EntryOffset, E.EntryLength});
+        Ranges.push_back({E.PathsOffset, E.PathsLength});
+        Ranges.push_back({E.LoopsOffset, E.LoopsLength});
+    }
+    if (GUIDs.empty())
+        report_fatal_error("Function " + FunctionName +
+                           " has no paths in profile " + ProfileFilename);
+
+    Ranges.erase(remove_if(Ranges.begin(), Ranges.end(),
+                           [](const pair<uint64_t, uint64_t> &R) {
+                               return R.second == 0;
+                           }),
+                 Ranges.end());
+    sort(Ranges.begin(), Ranges.end());
+    Reader->restrict(Ranges);
+
+    auto Encodings = readEncodingFile(EncodingFilename, &GUIDs);
+    printProfile(*Reader, lookupIn(Encodings));
+}
+
 char EPPPathPrinter::ID = 0;
@@ -0,0 +1,113 @@
+#define DEBUG_TYPE "epp_plugin"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Scalar.h"
+
+#include "BreakSelfLoopsPass.h"
+#include "EPPProfile.h"
+#include "SplitLandingPadPredsPass.h"
+
+using namespace llvm;
+using namespace epp;
+using namespace std;
+
+// The instrumentation library reads these options, llvm-epp defines them
+// with short names. Inside clang they are passed with -mllvm.
+
+cl::opt<string> profileOutputFilename(
+    "epp-output", cl::desc("Filename of the output path profile"),
+    cl::value_desc("filename"), cl::init("path-profile-results.txt"));
+
+cl::opt<bool> dumpGraphs("epp-dump-graphs",
+                         cl::desc("Dump dot graphs of the different stages."),
+                         cl::Hidden, cl::init(false));
+
+cl::opt<unsigned> loopIterations(
+    "epp-k", cl::desc("Also profile windows of k consecutive iteration "
+                      "paths of innermost loops (k > 1)"),
+    cl::value_desc("iterations"), cl::init(0));
+
+cl::opt<unsigned>
+    numJobs("epp-jobs", cl::desc("Number of threads used to encode functions"),
+            cl::value_desc("threads"), cl::init(1));
+
+namespace {
+
+enum InsertionPoint { Early, Late };
+
+cl::opt<InsertionPoint> insertionPoint(
+    "epp-insertion-point",
+    cl::desc("Where to instrument in the optimization pipeline"),
+    cl::values(clEnumValN(Early, "early", "Before inlining"),
+               clEnumValN(Late, "late",
+                          "After inlining and loop optimizations")),
+    cl::init(Late));
+
+cl::opt<string> saveModuleFilename(
+    "epp-save-module",
+    cl::desc("Save the module as seen by the instrumentation. This is the "
+             "module to decode the profile with, llvm-epp -p"),
+    cl::value_desc("filename"));
+
+/// Write the module before it is prepared and instrumented, which is
+/// what llvm-epp gets as input for both instrumentation and decoding.
+struct EPPSaveModule : public ModulePass {
+    static char ID;
+    EPPSaveModule() : ModulePass(ID) {}
+
+    bool runOnModule(Module &M) override {
+        error_code EC;
+        raw_fd_ostream Out(saveModuleFilename, EC, sys::fs::F_None);
+        if (EC) {
+            report_fatal_error("error saving llvm module to '" +
+                               saveModuleFilename + "': \n" + EC.message());
+        }
+        WriteBitcodeToFile(&M, Out);
+        return false;
+    }
+
+    StringRef getPassName() const override { return "EPPSaveModule"; }
+};
+
+char EPPSaveModule::ID = 0;
+
+/// The same pipeline llvm-epp runs on its input module.
+void addEPPPasses(legacy::PassManagerBase &PM) {
+    if (!saveModuleFilename.empty())
+        PM.add(new EPPSaveModule());
+    PM.add(createLoopSimplifyPass());
+    PM.add(new epp::BreakSelfLoopsPass());
+    PM.add(createBreakCriticalEdgesPass());
+    PM.add(new epp::SplitLandingPadPredsPass());
+    PM.add(new LoopInfoWrapperPass());
+    PM.add(new epp::EPPProfile());
+}
+
+void addEarly(const PassManagerBuilder &, legacy::PassManagerBase &PM) {
+    if (insertionPoint == Early)
+        addEPPPasses(PM);
+}
+
+void addLate(const PassManagerBuilder &, legacy::PassManagerBase &PM) {
+    if (insertionPoint == Late)
+        addEPPPasses(PM);
+}
+
+void addO0(const PassManagerBuilder &, legacy::PassManagerBase &PM) {
+    addEPPPasses(PM);
+}
+}
+
+static RegisterStandardPasses
+    EarlyEPP(PassManagerBuilder::EP_ModuleOptimizerEarly, addEarly);
+static RegisterStandardPasses LateEPP(PassManagerBuilder::EP_OptimizerLast,
+                                      addLate);
+static RegisterStandardPasses
+    O0EPP(PassManagerBuilder::EP_EnabledOnOptLevel0, addO0);
@@ -1,5 +1,6 @@
 #define DEBUG_TYPE "epp_profile"
 #include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/Analysis/CFG.h"
@@ -16,11 +17,13 @@
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/GraphWriter.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/ModuleUtils.h"
 
 #include "EPPEncode.h"
 #include "EPPProfile.h"
+#include "FunctionEncoding.h"
 
 #include <cassert>
 #include <tuple>
@@ -31,10 +34,22 @@ using namespace epp;
 using namespace std;
 
 extern cl::opt<string> profileOutputFilename;
-
+extern cl::opt<unsigned> loopIterations;
+extern cl::opt<unsigned> numJobs;
+extern cl::opt<bool> dumpGraphs;
+
+/// Functions are logged with a dense index into the table of function
+/// GUIDs registered with the runtime, which keys the profile by GUID. The
+/// index is relative to the first function of the module, as the runtime
+/// registers the tables of all the modules linked together.
 bool EPPProfile::doInitialization(Module &M) {
+    if (loopIterations > MaxLoopIterations)
+        report_fatal_error("-k must be at most " + Twine(MaxLoopIterations));
+
     uint32_t Id = 0;
     for (auto &F : M) {
+        if (F.isDeclaration())
+            continue;
         FunctionIds[&F] = Id++;
     }
 
@@ -45,8 +60,9 @@ bool EPPProfile::doFinalization(Module &M) { return false; }
 
 namespace {
 
-uint64_t NumInstInc = 0;
-uint64_t NumInstLog = 0;
+// Modules of a batch are instrumented on several threads.
+thread_local uint64_t NumInstInc = 0;
+thread_local uint64_t NumInstLog = 0;
 
 void saveModule(Module &m, StringRef filename) {
     error_code EC;
@@ -69,15 +85,14 @@ SmallVector<BasicBlock *, 1> getFunctionExitBlocks(Function &F) {
     return R;
 }
 
-void insertInc(BasicBlock *Block, APInt Inc, AllocaInst *Ctr) {
-    if (Inc.ne(APInt(64, 0, true))) {
+void insertInc(BasicBlock *Block, uint64_t Inc, AllocaInst *Ctr) {
+    if (Inc != 0) {
         //(errs() << "Inserting Increment " << Increment << " "
         //<< addPos->getParent()->getName() << "\n");
         auto *addPos = &*Block->getFirstInsertionPt();
         auto *LI     = new LoadInst(Ctr, "ld.epp.ctr", addPos);
 
-        Constant *CI =
-            ConstantInt::getIntegerValue(Ctr->getAllocatedType(), Inc);
+        Constant *CI = ConstantInt::get(Ctr->getAllocatedType(), Inc, false);
         auto *BI = BinaryOperator::CreateAdd(LI, CI);
         BI->insertAfter(LI);
         (new StoreInst(BI, Ctr))->insertAfter(BI);
@@ -130,8 +145,8 @@ BasicBlock *interpose(BasicBlock *BB, BasicBlock *Succ,
     return SplitBlock(BB, BB->getTerminator(), DT, LI);
 }
 
-void insertLogPath(BasicBlock *BB, uint64_t FuncId, AllocaInst *Ctr,
-                   Constant *Zap) {
+CallInst *insertLogPath(BasicBlock *BB, GlobalVariable *Base,
+                        uint64_t FuncId, AllocaInst *Ctr, Constant *Zap) {
 
     //errs() << "Inserting Log: " << BB->getName() << "\n";
     //errs() << *BB << "\n";
@@ -140,7 +155,6 @@ void insertLogPath(BasicBlock *BB, uint64_t FuncId, AllocaInst *Ctr,
     auto &Ctx    = M->getContext();
     auto *voidTy = Type::getVoidTy(Ctx);
     auto *CtrTy  = Ctr->getAllocatedType();
-    auto *FIdArg = ConstantInt::getIntegerValue(CtrTy, APInt(64, FuncId, true));
     Function *logFun2 = cast<Function>(
         M->getOrInsertFunction("__epp_logPath", voidTy, CtrTy, CtrTy));
 
@@ -149,47 +163,118 @@ void insertLogPath(BasicBlock *BB, uint64_t FuncId, AllocaInst *Ctr,
     // as we know for sure that there is no other instrumentation present in
     // this basic block.
     Instruction *logPos = &*BB->getFirstInsertionPt();
-    auto *LI               = new LoadInst(Ctr, "ld.epp.ctr", logPos);
-    vector<Value *> Params = {LI, FIdArg};
-    auto *CI               = CallInst::Create(logFun2, Params, "");
-    CI->insertAfter(LI);
-    (new StoreInst(Zap, Ctr))->insertAfter(CI);
+    auto *LI    = new LoadInst(Ctr, "ld.epp.ctr", logPos);
+    auto *Start = new LoadInst(Base, "ld.epp.base", logPos);
+    auto *FId   = BinaryOperator::CreateAdd(
+        Start, ConstantInt::get(CtrTy, FuncId, false), "epp.fid", logPos);
+    vector<Value *> Params = {LI, FId};
+    auto *CI               = CallInst::Create(logFun2, Params, "", logPos);
+    new StoreInst(Zap, Ctr, logPos);
 
 
     ++NumInstLog;
+    return CI;
 }
 
+Constant *getNameConstant(Module &M, StringRef Name) {
+    auto *Str = ConstantDataArray::getString(M.getContext(), Name);
+    auto *GV  = new GlobalVariable(M, Str->getType(), true,
+                                  GlobalValue::PrivateLinkage, Str,
+                                  "__epp_functionName");
+    GV->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+    return ConstantExpr::getPointerCast(GV,
+                                        Type::getInt8PtrTy(M.getContext()));
+}
+
+/// Compute the encodings of the given functions on a thread pool. Encoding
+/// only reads the CFG of a function, the IR is modified afterwards by
+/// instrumenting one function at a time in module order. This keeps the
+/// output identical to encoding each function on demand.
+vector<unique_ptr<EPPEncode>> encodeFunctions(ArrayRef<Function *> Functions,
+                                              unsigned Jobs) {
+    vector<unique_ptr<EPPEncode>> Encodings(Functions.size());
+    ThreadPool Pool(Jobs);
+    for (size_t I = 0; I < Functions.size(); I++) {
+        Pool.async([&Encodings, &Functions, I]() {
+            Encodings[I] = EPPEncode::compute(*Functions[I]);
+        });
+    }
+    Pool.wait();
+    return Encodings;
+}
+
+/// Push the path id logged by Log into the iteration history of a loop.
+/// The runtime records a window each time the history holds K paths.
+void insertLogLoopPath(CallInst *Log, uint32_t LoopId, AllocaInst *Hist) {
+    Module *M     = Log->getModule();
+    auto &Ctx     = M->getContext();
+    auto *voidTy  = Type::getVoidTy(Ctx);
+    auto *int32Ty = Type::getInt32Ty(Ctx);
+    auto *int64Ty = Type::getInt64Ty(Ctx);
+    Function *logLoopFun = cast<Function>(M->getOrInsertFunction(
+        "__epp_logLoopPath", voidTy, Hist->getType(), int64Ty, int64Ty,
+        int32Ty, int32Ty));
+
+    vector<Value *> Params = {Hist, Log->getArgOperand(0),
+                              Log->getArgOperand(1),
+                              ConstantInt::get(int32Ty, LoopId, false),
+                              ConstantInt::get(int32Ty, loopIterations, false)};
+    CallInst::Create(logLoopFun, Params, "")->insertAfter(Log);
+}
 }
 
 void EPPProfile::addCtorsAndDtors(Module &Mod) {
     auto &Ctx                  = Mod.getContext();
     auto *voidTy               = Type::getVoidTy(Ctx);
     auto *int32Ty              = Type::getInt32Ty(Ctx);
+    auto *int64Ty              = Type::getInt64Ty(Ctx);
     auto *int8PtrTy            = Type::getInt8PtrTy(Ctx, 0);
     uint32_t NumberOfFunctions = FunctionIds.size();
 
-    auto *EPPInit = cast<Function>(
-        Mod.getOrInsertFunction("__epp_init", voidTy, int32Ty));
+    // The function table, indexed by the id each function is logged with.
+    // The runtime saves the entries of the executed functions with the
+    // profile so that the decoder can check it against the module.
+    auto *EntryTy = StructType::get(int64Ty, int64Ty, int64Ty, int8PtrTy);
+    SmallVector<Constant *, 32> Entries(NumberOfFunctions);
+    for (auto &FI : FunctionIds) {
+        auto *F   = FI.first;
+        auto Info = FunctionInfo.lookup(F);
+
+        Entries[FI.second] = ConstantStruct::get(
+            EntryTy, ConstantInt::get(int64Ty, getFunctionGUID(*F), false),
+            ConstantInt::get(int64Ty, Info.first, false),
+            ConstantInt::get(int64Ty, Info.second, false),
+            getNameConstant(Mod, F->getName()));
+    }
+    auto *TableTy  = ArrayType::get(EntryTy, NumberOfFunctions);
+    auto *TableVar = new GlobalVariable(
+        Mod, TableTy, true, GlobalValue::PrivateLinkage,
+        ConstantArray::get(TableTy, Entries), "__epp_functionTable");
+
+    auto *EPPInit = cast<Function>(Mod.getOrInsertFunction(
+        "__epp_init", int64Ty, EntryTy->getPointerTo(), int32Ty));
     auto *EPPSave = cast<Function>(
         Mod.getOrInsertFunction("__epp_save", voidTy, int8PtrTy));
 
-    // Add Global Constructor for initializing path profiling
-    auto *EPPInitCtor =
-        cast<Function>(Mod.getOrInsertFunction("__epp_ctor", voidTy));
+    // Add Global Constructor for initializing path profiling. The
+    // constructor and destructor are local to the module, every module
+    // linked into the program registers its table.
+    auto *VoidFnTy    = FunctionType::get(voidTy, false);
+    auto *EPPInitCtor = Function::Create(
+        VoidFnTy, GlobalValue::InternalLinkage, "__epp_ctor", &Mod);
     auto *CtorBB = BasicBlock::Create(Ctx, "entry", EPPInitCtor);
-    auto *Arg    = ConstantInt::get(int32Ty, NumberOfFunctions, false);
-    CallInst::Create(EPPInit, {Arg}, "", CtorBB);
-    ReturnInst::Create(Ctx, CtorBB);
-    appendToGlobalCtors(Mod, EPPInitCtor, 0);
-
+    IRBuilder<> CtorBuilder(CtorBB);
+    auto *Table  =
+        CtorBuilder.CreateConstInBoundsGEP2_32(TableTy, TableVar, 0, 0);
     auto *Number = ConstantInt::get(int32Ty, NumberOfFunctions, false);
-    new GlobalVariable(Mod, Number->getType(), false,
-                       GlobalValue::ExternalLinkage, Number,
-                       "__epp_numberOfFunctions");
+    CtorBuilder.CreateStore(CtorBuilder.CreateCall(EPPInit, {Table, Number}),
+                            FunctionBase);
+    CtorBuilder.CreateRetVoid();
+    appendToGlobalCtors(Mod, EPPInitCtor, 0);
 
     // Add global destructor to dump out results
-    auto *EPPSaveDtor =
-        cast<Function>(Mod.getOrInsertFunction("__epp_dtor", voidTy));
+    auto *EPPSaveDtor = Function::Create(
+        VoidFnTy, GlobalValue::InternalLinkage, "__epp_dtor", &Mod);
     auto *DtorBB = BasicBlock::Create(Ctx, "entry", EPPSaveDtor);
     IRBuilder<> Builder(DtorBB);
     Builder.CreateCall(
@@ -197,32 +282,70 @@ void EPPProfile::addCtorsAndDtors(Module &Mod) {
         {Builder.CreateGlobalStringPtr(profileOutputFilename.getValue())});
     Builder.CreateRet(nullptr);
 
-    appendToGlobalDtors(Mod, cast<Function>(EPPSaveDtor), 0);
+    appendToGlobalDtors(Mod, EPPSaveDtor, 0);
 }
 
 bool EPPProfile::runOnModule(Module &Mod) {
     DEBUG(errs() << "Running Profile\n");
 
-    errs() << "# Instrumented Functions\n";
+    string Unused, EncodingText;
+    raw_string_ostream ReportBuffer(Batch ? Batch->Report : Unused);
+    raw_string_ostream EncOut(Batch ? Batch->Encodings : EncodingText);
+    raw_ostream &Report =
+        Batch ? static_cast<raw_ostream &>(ReportBuffer) : errs();
+
+    Report << "# Instrumented Functions\n";
+
+    auto *int64Ty = Type::getInt64Ty(Mod.getContext());
+    FunctionBase  = new GlobalVariable(Mod, int64Ty, false,
+                                      GlobalValue::PrivateLinkage,
+                                      ConstantInt::get(int64Ty, 0),
+                                      "__epp_functionBase");
 
+    SmallVector<Function *, 32> Functions;
     for (auto &F : Mod) {
-        if (F.isDeclaration())
-            continue;
+        if (!F.isDeclaration())
+            Functions.push_back(&F);
+    }
+
+    // The dot graphs are written to fixed filenames, so only encode in
+    // parallel when they are not requested. The modules of a batch are
+    // already instrumented in parallel.
+    vector<unique_ptr<EPPEncode>> Encodings;
+    bool Parallel = numJobs > 1 && !dumpGraphs && !Batch;
+    if (Parallel)
+        Encodings = encodeFunctions(Functions, numJobs);
 
-        auto &Enc     = getAnalysis<EPPEncode>(F);
+    for (size_t I = 0; I < Functions.size(); I++) {
+        auto &F = *Functions[I];
+
+        auto &Enc     = Parallel ? *Encodings[I] : getAnalysis<EPPEncode>(F);
         auto NumPaths = Enc.numPaths[&F.getEntryBlock()];
 
-        errs() << "- name: " << F.getName() << "\n";
-        errs() << "  num_paths: " << NumPaths << "\n";
+        FunctionInfo[&F] = {NumPaths, Enc.CFGHash};
+
+        Report << "- name: " << F.getName() << "\n";
+        Report << "  num_paths: " << NumPaths << "\n";
         // Check if integer overflow occurred during path enumeration,
         // if it did then the entry block numpaths is set to zero.
-        if (NumPaths.ne(APInt(64, 0, true))) {
+        if (NumPaths != 0) {
+            writeFunctionEncoding(EncOut, FunctionEncoding::get(F, Enc));
             instrument(F, Enc);
-            errs() << "  num_inst_inc: " << NumInstInc << "\n";
-            errs() << "  num_inst_log: " << NumInstLog << "\n";
+            Report << "  num_inst_inc: " << NumInstInc << "\n";
+            Report << "  num_inst_log: " << NumInstLog << "\n";
         }
+
+        // Release the encoding and its auxiliary graph early.
+        if (Parallel)
+            Encodings[I].reset();
     }
 
+    // The encodings are also saved next to the profile, so that it can
+    // be decoded without the module. A batch saves those of all its
+    // modules at once.
+    if (!Batch)
+        appendEncodingFile(profileOutputFilename + ".enc", EncOut.str());
+
     addCtorsAndDtors(Mod);
 
     return true;
@@ -265,42 +388,60 @@ void EPPProfile::instrument(Function &F, EPPEncode &Enc) {
 
     auto ExitBlocks = getFunctionExitBlocks(F);
 
+    // For k-iteration loop path profiling each innermost loop gets a
+    // history of the last K iteration paths, preceded by the number of
+    // valid entries. The history is reset in the loop preheader.
+    SmallVector<pair<BasicBlock *, AllocaInst *>, 4> LoopHists;
+    DenseMap<Loop *, AllocaInst *> HistOf;
+    if (loopIterations > 1) {
+        for (auto *L : Enc.InnermostLoops) {
+            auto *PH = L->getLoopPreheader();
+            if (!PH)
+                continue;
+            auto *Hist = new AllocaInst(
+                CtrTy, DL.getAllocaAddrSpace(),
+                ConstantInt::get(Type::getInt32Ty(Ctx), loopIterations + 1),
+                "epp.loop.hist");
+            LoopHists.push_back({PH, Hist});
+            HistOf[L] = Hist;
+        }
+    }
+
     // Get all the non-zero real edges to instrument
     const auto &Wts = Enc.AG.getWeights();
 
     // Enc.AG.printWeights();
 
-    for (auto &W : Wts) {
-        auto &Ptr       = W.first;
-        BasicBlock *Src = Ptr->src, *Tgt = Ptr->tgt;
+    for (auto *W : Wts) {
+        BasicBlock *Src = W->src, *Tgt = W->tgt;
         BasicBlock *N = interpose(Src, Tgt);
-        insertInc(N, W.second, Ctr);
+        insertInc(N, W->weight, Ctr);
     }
 
     // Get the weights for the segmented edges
-    const auto &SegMap = Enc.AG.getSegmentMap();
-
-    for (auto &S : SegMap) {
-        auto &Ptr       = S.first;
-        BasicBlock *Src = Ptr->src, *Tgt = Ptr->tgt;
+    for (auto &S : Enc.AG.segments()) {
+        BasicBlock *Src = S.src, *Tgt = S.tgt;
 
-        auto &AExit  = S.second.first;
-        APInt Pre    = Enc.AG.getEdgeWeight(AExit);
-        auto &EntryB = S.second.second;
-        APInt Post   = Enc.AG.getEdgeWeight(EntryB);
+        uint64_t Pre  = Enc.AG[S.AExit].weight;
+        uint64_t Post = Enc.AG[S.EntryB].weight;
 
         BasicBlock *N = interpose(Src, Tgt);
 
         // Since we always add instrumentation
         insertInc(N, Post, Ctr);
-        insertLogPath(N, FuncId, Ctr, Zap);
+        auto *Log = insertLogPath(N, FunctionBase, FuncId, Ctr, Zap);
         insertInc(N, Pre, Ctr);
+
+        if (auto *L = Enc.getBackEdgeLoop(Src, Tgt)) {
+            if (auto *Hist = HistOf.lookup(L))
+                insertLogLoopPath(Log, Enc.getLoopId(L), Hist);
+        }
     }
 
     // Add the logpath function for all function exiting
     // basic blocks.
     for (auto &EB : ExitBlocks) {
-        insertLogPath(EB, FuncId, Ctr, Zap);
+        insertLogPath(EB, FunctionBase, FuncId, Ctr, Zap);
     }
 
     // Add the counter as the first instruction in the entry
@@ -309,6 +450,11 @@ void EPPProfile::instrument(Function &F, EPPEncode &Enc) {
     auto *SI = new StoreInst(Zap, Ctr);
     SI->insertAfter(Ctr);
 
+    for (auto &LH : LoopHists) {
+        LH.second->insertAfter(Ctr);
+        new StoreInst(Zap, LH.second, LH.first->getTerminator());
+    }
+
     // saveModule(*M, "test.bc");
 }
 
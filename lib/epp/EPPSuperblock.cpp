@@ -0,0 +1,260 @@
+#define DEBUG_TYPE "epp_superblock"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+#include <algorithm>
+
+#include "EPPSuperblock.h"
+
+using namespace llvm;
+using namespace epp;
+using namespace std;
+
+extern cl::opt<string> profile;
+extern cl::opt<unsigned> superblockPaths;
+extern cl::opt<unsigned> superblockGrowth;
+
+namespace {
+
+/// Blocks which are not entered through a plain branch, and instructions
+/// which must not be made control dependent on more branches, stay where
+/// they are.
+bool canDuplicate(const BasicBlock &BB) {
+    if (BB.isEHPad() || BB.hasAddressTaken())
+        return false;
+    for (auto &I : BB) {
+        if (I.getType()->isTokenTy())
+            return false;
+        ImmutableCallSite CS(&I);
+        if (CS && (CS.cannotDuplicate() || CS.isConvergent()))
+            return false;
+    }
+    return true;
+}
+
+unsigned countInstructions(const Function &F) {
+    unsigned Count = 0;
+    for (auto &BB : F)
+        Count += BB.size();
+    return Count;
+}
+
+bool isSuccessor(const BasicBlock *BB, const BasicBlock *Succ) {
+    return find(succ_begin(BB), succ_end(BB), Succ) != succ_end(BB);
+}
+
+/// A block which dominates one of its reachable predecessors heads a loop.
+bool isLoopHeader(BasicBlock *BB, const DominatorTree &DT) {
+    return any_of(predecessors(BB), [&](BasicBlock *Pred) {
+        return DT.isReachableFromEntry(Pred) && DT.dominates(BB, Pred);
+    });
+}
+}
+
+/// The paths are collected for every function first, the blocks of a path
+/// are only valid as long as the function is unchanged.
+TraceMap epp::getHotTraces(EPPDecode &D, StringRef ProfileFilename,
+                           unsigned N) {
+    TraceMap Traces;
+    auto ByFreq = [](const Path &A, const Path &B) { return A.Freq > B.Freq; };
+    auto Collect = [&](Function &F, MutableArrayRef<Path> Paths) {
+        stable_sort(Paths.begin(), Paths.end(), ByFreq);
+        auto &FTraces = Traces[&F];
+        for (auto &P : Paths.take_front(min<size_t>(N, Paths.size()))) {
+            if (P.Blocks.size() > 1)
+                FTraces.push_back(std::move(P.Blocks));
+        }
+    };
+    decodeProfile(D, ProfileFilename, Collect);
+    return Traces;
+}
+
+bool epp::isTraceAvailable(ArrayRef<BasicBlock *> Trace,
+                           const SmallPtrSetImpl<BasicBlock *> &Used) {
+    for (uint32_t I = 0; I < Trace.size(); I++) {
+        if (Used.count(Trace[I]) ||
+            (I > 0 && !isSuccessor(Trace[I - 1], Trace[I])))
+            return false;
+    }
+    return true;
+}
+
+bool EPPSuperblock::runOnModule(Module &M) {
+    EPPDecode &D = getAnalysis<EPPDecode>();
+    auto Traces  = getHotTraces(D, profile, superblockPaths);
+    for (auto &F : M) {
+        auto It = Traces.find(&F);
+        if (It != Traces.end())
+            formSuperblocks(F, It->second);
+    }
+
+    errs() << "# Formed " << NumSuperblocks << " superblocks, duplicated "
+           << NumDuplicated << " instructions\n";
+    return NumSuperblocks > 0;
+}
+
+/// Traces are formed from the hottest down and do not share blocks. A
+/// trace whose edges were redirected into the superblock of a hotter one
+/// is left alone. The budget is a share of the size of the function
+/// before any duplication, and the last superblock formed is cut short
+/// when it runs out.
+void EPPSuperblock::formSuperblocks(Function &F,
+                                    ArrayRef<vector<BasicBlock *>> Traces) {
+    unsigned Budget = countInstructions(F) * superblockGrowth / 100;
+    SmallPtrSet<BasicBlock *, 16> Used;
+    for (auto &Trace : Traces) {
+        if (!isTraceAvailable(Trace, Used))
+            continue;
+
+        unsigned Duplicated = formSuperblock(Trace, Budget);
+        if (Duplicated == 0)
+            continue;
+
+        DEBUG(errs() << "Superblock of " << Duplicated
+                     << " instructions in " << F.getName() << "\n");
+        Budget -= Duplicated;
+        NumDuplicated += Duplicated;
+        NumSuperblocks++;
+        Used.insert(Trace.begin(), Trace.end());
+    }
+}
+
+/// Duplicate the blocks of the trace from its first side entrance on, as
+/// far as the budget goes, and redirect the trace into the copies. The
+/// copies are only entered from the head and from each other, so their phis
+/// keep the values of those edges. The copies stop before a loop header: a
+/// path can reach the latch of an inner loop, and the copy of the header
+/// would then also be entered from the copy of the latch, forming a second
+/// copy of the loop. The successors which leave the trace get an incoming
+/// value for the copy, and the uses of values defined on the trace which
+/// both the block and its copy now reach are rewritten in SSA form.
+unsigned epp::formSuperblock(ArrayRef<BasicBlock *> Trace, unsigned Budget,
+                             SmallVectorImpl<BasicBlock *> *Superblock) {
+    unsigned First = 1;
+    while (First < Trace.size() &&
+           Trace[First]->getSinglePredecessor() == Trace[First - 1])
+        First++;
+    if (Superblock)
+        Superblock->append(Trace.begin(), Trace.begin() + First);
+    auto *Head = Trace[First - 1];
+    if (First == Trace.size() || isa<IndirectBrInst>(Head->getTerminator()))
+        return 0;
+
+    auto *F = Head->getParent();
+    DominatorTree DT(*F);
+    unsigned Last = First, Cost = 0;
+    while (Last < Trace.size() && canDuplicate(*Trace[Last]) &&
+           !isLoopHeader(Trace[Last], DT) &&
+           Cost + Trace[Last]->size() <= Budget) {
+        Cost += Trace[Last]->size();
+        Last++;
+    }
+    if (Last == First)
+        return 0;
+    auto Tail = Trace.slice(First, Last - First);
+
+    ValueToValueMapTy VMap;
+    SmallVector<BasicBlock *, 8> Clones;
+    for (auto *BB : Tail) {
+        auto *Clone = CloneBasicBlock(BB, VMap, ".sb", F);
+        VMap[BB]    = Clone;
+        Clones.push_back(Clone);
+    }
+    // Branches between blocks of the tail now stay within the copies.
+    for (auto *Clone : Clones) {
+        for (auto &I : *Clone)
+            RemapInstruction(&I, VMap,
+                             RF_NoModuleLevelChanges | RF_IgnoreMissingLocals);
+    }
+
+    auto *T = Head->getTerminator();
+    for (unsigned I = 0; I < T->getNumSuccessors(); I++) {
+        if (T->getSuccessor(I) == Tail[0]) {
+            Tail[0]->removePredecessor(Head, true);
+            T->setSuccessor(I, Clones[0]);
+        }
+    }
+
+    for (unsigned I = 0; I < Tail.size(); I++) {
+        SmallPtrSet<BasicBlock *, 4> Preds(pred_begin(Clones[I]),
+                                           pred_end(Clones[I]));
+        for (auto &Inst : *Clones[I]) {
+            auto *PN = dyn_cast<PHINode>(&Inst);
+            if (!PN)
+                break;
+            for (unsigned J = PN->getNumIncomingValues(); J-- > 0;) {
+                if (!Preds.count(PN->getIncomingBlock(J)))
+                    PN->removeIncomingValue(J, false);
+            }
+        }
+
+        // One entry per edge, as with the original block.
+        auto *CT = Clones[I]->getTerminator();
+        for (unsigned J = 0; J < CT->getNumSuccessors(); J++) {
+            auto *Succ = CT->getSuccessor(J);
+            if (is_contained(Clones, Succ))
+                continue;
+            for (auto &Inst : *Succ) {
+                auto *PN = dyn_cast<PHINode>(&Inst);
+                if (!PN)
+                    break;
+                Value *V = PN->getIncomingValueForBlock(Tail[I]);
+                auto VIt = VMap.find(V);
+                if (VIt != VMap.end())
+                    V = VIt->second;
+                PN->addIncoming(V, Clones[I]);
+            }
+        }
+    }
+
+    SSAUpdater Updater;
+    SmallVector<Use *, 8> Uses;
+    for (unsigned I = 0; I < Tail.size(); I++) {
+        for (auto &Inst : *Tail[I]) {
+            Uses.clear();
+            for (auto &U : Inst.uses()) {
+                auto *User   = cast<Instruction>(U.getUser());
+                auto *UserBB = User->getParent();
+                if (auto *PN = dyn_cast<PHINode>(User))
+                    UserBB = PN->getIncomingBlock(U);
+                if (UserBB != Tail[I])
+                    Uses.push_back(&U);
+            }
+            if (Uses.empty())
+                continue;
+
+            Updater.Initialize(Inst.getType(), Inst.getName());
+            Updater.AddAvailableValue(Tail[I], &Inst);
+            Updater.AddAvailableValue(Clones[I], VMap[&Inst]);
+            for (auto *U : Uses)
+                Updater.RewriteUse(*U);
+        }
+    }
+
+    // Phis of the copies left with a single value fold away.
+    for (auto *Clone : Clones) {
+        for (auto It = Clone->begin(); isa<PHINode>(It);) {
+            auto *PN = cast<PHINode>(It++);
+            if (auto *V = PN->hasConstantValue()) {
+                PN->replaceAllUsesWith(V);
+                PN->eraseFromParent();
+            }
+        }
+    }
+
+    if (Superblock)
+        Superblock->append(Clones.begin(), Clones.end());
+    return Cost;
+}
+
+char EPPSuperblock::ID = 0;
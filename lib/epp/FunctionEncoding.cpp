@@ -0,0 +1,371 @@
+#define DEBUG_TYPE "epp_encoding"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/IR/DebugInfo.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+
+#include <algorithm>
+#include <fstream>
+#include <limits>
+#include <sstream>
+
+#include "AuxGraph.h"
+#include "EPPEncode.h"
+#include "FunctionEncoding.h"
+
+using namespace llvm;
+using namespace epp;
+using namespace std;
+
+namespace {
+
+/// Append the source locations of the instructions of a block, skipping
+/// consecutive duplicates. File names are interned in FileIds.
+void addLocations(const BasicBlock &BB, FunctionEncoding &FE,
+                  StringMap<uint32_t> &FileIds) {
+    auto Begin = FE.Locs.size();
+    for (auto &I : BB) {
+        auto &Loc = I.getDebugLoc();
+        if (!Loc)
+            continue;
+        auto File = FileIds.insert({Loc->getFilename(), FE.Files.size()});
+        if (File.second)
+            FE.Files.push_back(Loc->getFilename().str());
+        FunctionEncoding::Location L = {File.first->second, Loc->getLine()};
+        if (FE.Locs.size() == Begin || FE.Locs.back() != L)
+            FE.Locs.push_back(L);
+    }
+}
+
+void malformed(StringRef What) {
+    report_fatal_error("Invalid encoding file: " + What);
+}
+}
+
+/// Take the parts of the encoding of a function needed for decoding. This
+/// has to be done before the function is instrumented, as instrumentation
+/// splits the edges of the CFG.
+FunctionEncoding FunctionEncoding::get(Function &F, const EPPEncode &Enc) {
+    FunctionEncoding FE;
+    FE.GUID     = getFunctionGUID(F);
+    FE.NumPaths = Enc.numPaths.lookup(&F.getEntryBlock());
+    FE.CFGHash  = Enc.CFGHash;
+    FE.Name     = F.getName().str();
+
+    auto Nodes = Enc.AG.nodes();
+    DenseMap<const BasicBlock *, uint32_t> Ids;
+    for (uint32_t I = 0; I < Nodes.size(); I++)
+        Ids[Nodes[I]] = I;
+
+    DenseMap<EdgeId, uint32_t> SegmentNodes;
+    for (auto &S : Enc.AG.segments()) {
+        SegmentNodes[S.AExit]  = Ids.lookup(S.tgt);
+        SegmentNodes[S.EntryB] = Ids.lookup(S.src);
+    }
+
+    StringMap<uint32_t> FileIds;
+    for (auto *N : Nodes) {
+        FE.Offsets.push_back(FE.Edges.size());
+        for (auto &E : Enc.AG.succs(N)) {
+            auto It = SegmentNodes.find(&E - Enc.AG.edges().data());
+            FE.Edges.push_back({Ids.lookup(E.tgt), E.weight, E.real,
+                                It == SegmentNodes.end() ? NoNode
+                                                         : It->second});
+        }
+        FE.LocOffsets.push_back(FE.Locs.size());
+        if (!Enc.AG.isExitBlock(N))
+            addLocations(*N, FE, FileIds);
+        FE.BlockNames.push_back(
+            Enc.AG.isExitBlock(N) ? string() : N->getName().str());
+    }
+    FE.Offsets.push_back(FE.Edges.size());
+    FE.LocOffsets.push_back(FE.Locs.size());
+
+    for (auto *L : Enc.InnermostLoops)
+        FE.LoopHeaders.push_back(L->getHeader()->getName().str());
+
+    FE.finalize();
+    return FE;
+}
+
+ArrayRef<FunctionEncoding::SuccEdge>
+FunctionEncoding::succs(uint32_t N) const {
+    return makeArrayRef(Edges).slice(Offsets[N], Offsets[N + 1] - Offsets[N]);
+}
+
+ArrayRef<FunctionEncoding::Location>
+FunctionEncoding::locations(uint32_t N) const {
+    return makeArrayRef(Locs).slice(LocOffsets[N],
+                                    LocOffsets[N + 1] - LocOffsets[N]);
+}
+
+/// Sort the successors of each node by weight and count the paths from
+/// each node. The Ball-Larus weights of the successors of a node already
+/// increase in successor order, since every node has at least one path to
+/// the exit; the sort only guards the binary search in decode. Nodes are
+/// in post order of a graph without back edges, so the successors of a
+/// node come before it.
+void FunctionEncoding::finalize() {
+    NodePaths.assign(numNodes(), 1);
+    for (uint32_t N = 0; N < numNodes(); N++) {
+        auto Begin = Edges.begin() + Offsets[N];
+        auto End   = Edges.begin() + Offsets[N + 1];
+        stable_sort(Begin, End, [](const SuccEdge &E1, const SuccEdge &E2) {
+            return E1.Weight < E2.Weight;
+        });
+        if (Begin != End)
+            NodePaths[N] = (End - 1)->Weight + NodePaths[(End - 1)->Tgt];
+    }
+}
+
+FunctionEncoding::NodePath FunctionEncoding::decode(uint64_t PathId) const {
+    return decode(makeArrayRef(PathId)).front();
+}
+
+/// Decode path ids into the nodes of the paths. At each node the path
+/// takes the edge with the largest weight not above the remaining path
+/// id, found by binary search.
+///
+/// The paths of a node with the base B of the weights taken to reach it
+/// are the ids in [B, B + NodePaths[N]). The decoded prefixes thus form a
+/// trie, which is walked depth first by decoding the ids in increasing
+/// order: a path only decodes the edges after the longest prefix it
+/// shares with the previously decoded path. Ids out of range, from a
+/// corrupt profile or encoding file, are returned as invalid paths.
+vector<FunctionEncoding::NodePath>
+FunctionEncoding::decode(ArrayRef<uint64_t> PathIds) const {
+    struct Frame {
+        uint32_t Node;
+        uint64_t Base;
+        const SuccEdge *In;
+    };
+
+    vector<uint32_t> Order(PathIds.size());
+    for (uint32_t I = 0; I < Order.size(); I++)
+        Order[I] = I;
+    sort(Order.begin(), Order.end(), [&PathIds](uint32_t I1, uint32_t I2) {
+        return PathIds[I1] < PathIds[I2];
+    });
+
+    vector<NodePath> Result(PathIds.size());
+    SmallVector<Frame, 32> Stack;
+    Stack.push_back({entry(), 0, nullptr});
+
+    for (auto I : Order) {
+        auto PathId = PathIds[I];
+        auto &R     = Result[I];
+        if (PathId >= NodePaths[entry()]) {
+            R.Valid = false;
+            continue;
+        }
+
+        // Keep the longest prefix of the last path containing this one.
+        while (Stack.size() > 1 &&
+               (PathId < Stack.back().Base ||
+                PathId - Stack.back().Base >= NodePaths[Stack.back().Node]))
+            Stack.pop_back();
+
+        while (R.Valid && !isExit(Stack.back().Node)) {
+            auto &Top  = Stack.back();
+            auto Succs = succs(Top.Node);
+            auto Rest  = PathId - Top.Base;
+            auto It    = upper_bound(Succs.begin(), Succs.end(), Rest,
+                                  [](uint64_t R, const SuccEdge &E) {
+                                      return R < E.Weight;
+                                  });
+            if (It == Succs.begin()) {
+                R.Valid = false;
+                break;
+            }
+            --It;
+            Stack.push_back({It->Tgt, Top.Base + It->Weight, It});
+        }
+
+        if (!R.Valid)
+            continue;
+        if (Stack.size() == 1) {
+            R.Nodes = {Stack.front().Node};
+            continue;
+        }
+
+        uint64_t Type = 0;
+        if (!Stack[1].In->Real)
+            Type |= 0x1;
+        if (!Stack.back().In->Real)
+            Type |= 0x2;
+
+        R.Type = static_cast<PathType>(Type);
+        R.Next = Stack.back().In->SegmentNode;
+        for (auto F = Stack.begin() + bool(Type & 0x1),
+                  E = Stack.end() - bool(Type & 0x2);
+             F != E; ++F)
+            R.Nodes.push_back(F->Node);
+    }
+    return Result;
+}
+
+/// Collect the source lines along a path, skipping consecutive duplicates.
+/// Duplicates within a node are already removed, so only the locations at
+/// the boundaries of the nodes are compared.
+void FunctionEncoding::getPathSrc(ArrayRef<uint32_t> Nodes,
+                                  vector<Location> &PathLocs) const {
+    PathLocs.clear();
+    for (auto N : Nodes) {
+        auto NodeLocs = locations(N);
+        if (NodeLocs.empty())
+            continue;
+        auto *L = NodeLocs.begin();
+        if (!PathLocs.empty() && PathLocs.back() == *L)
+            ++L;
+        PathLocs.insert(PathLocs.end(), L, NodeLocs.end());
+    }
+}
+
+void FunctionEncoding::printPathSrc(ArrayRef<uint32_t> Nodes, raw_ostream &out,
+                                    StringRef prefix) const {
+    vector<Location> PathLocs;
+    getPathSrc(Nodes, PathLocs);
+    for (auto &L : PathLocs)
+        out << prefix << "- " << Files[L.File] << "," << L.Line << "\n";
+}
+
+/// The encoding file has one section per function:
+///
+///   function <guid> <num paths> <cfg hash> <files> <nodes> <loops> <name>
+///   <file name>                                  (one line per file)
+///   <succs> {<tgt> <weight> <real> <seg>} <locs> {<file> <line>} <block>
+///   <loop header name>                           (one line per loop)
+///
+/// File names are stored once per function and referred to by index. The
+/// segment node of an edge is stored plus one, 0 for none.
+void epp::writeFunctionEncoding(raw_ostream &OS, const FunctionEncoding &FE) {
+    OS << "function " << format_hex_no_prefix(FE.GUID, 16) << " "
+       << FE.NumPaths << " " << format_hex_no_prefix(FE.CFGHash, 16) << " "
+       << FE.Files.size() << " " << FE.numNodes() << " "
+       << FE.LoopHeaders.size() << " " << FE.Name << "\n";
+    for (auto &File : FE.Files)
+        OS << File << "\n";
+    for (uint32_t N = 0; N < FE.numNodes(); N++) {
+        auto Succs = FE.succs(N);
+        OS << Succs.size();
+        for (auto &SE : Succs)
+            OS << " " << SE.Tgt << " " << SE.Weight << " " << SE.Real << " "
+               << SE.SegmentNode + 1;
+        auto Locs = FE.locations(N);
+        OS << " " << Locs.size();
+        for (auto &L : Locs)
+            OS << " " << L.File << " " << L.Line;
+        OS << " " << FE.BlockNames[N] << "\n";
+    }
+    for (auto &Header : FE.LoopHeaders)
+        OS << Header << "\n";
+}
+
+/// Read the next function of an encoding file. Returns false at the end
+/// of the file. The header of a function gives the number of lines which
+/// follow it, so the functions not Wanted are skipped without parsing
+/// them.
+bool epp::readFunctionEncoding(istream &In, FunctionEncoding &FE,
+                               const DenseSet<uint64_t> *Wanted) {
+    string Line, Tag;
+    uint32_t NumFiles, NumNodes, NumLoops;
+    while (true) {
+        if (!getline(In, Line))
+            return false;
+
+        NumFiles = NumNodes = NumLoops = 0;
+        stringstream SS(Line);
+        SS >> Tag >> hex >> FE.GUID >> dec >> FE.NumPaths >> hex >>
+            FE.CFGHash >> dec >> NumFiles >> NumNodes >> NumLoops >> ws;
+        getline(SS, FE.Name);
+        if (Tag != "function" || SS.fail() || NumNodes == 0)
+            malformed("expected a function header");
+        if (!Wanted || Wanted->count(FE.GUID))
+            break;
+
+        for (uint64_t I = 0; I < uint64_t(NumFiles) + NumNodes + NumLoops; I++)
+            In.ignore(numeric_limits<streamsize>::max(), '\n');
+    }
+
+    FE.Files.resize(NumFiles);
+    for (auto &File : FE.Files)
+        getline(In, File);
+
+    FE.Offsets.assign(1, 0);
+    FE.Edges.clear();
+    FE.LocOffsets.assign(1, 0);
+    FE.Locs.clear();
+    FE.BlockNames.assign(NumNodes, string());
+    for (uint32_t N = 0; N < NumNodes; N++) {
+        if (!getline(In, Line))
+            malformed("missing nodes of " + FE.Name);
+        stringstream NS(Line);
+
+        uint32_t NumSuccs = 0, NumLocs = 0;
+        NS >> NumSuccs;
+        for (uint32_t I = 0; I < NumSuccs; I++) {
+            FunctionEncoding::SuccEdge SE;
+            NS >> SE.Tgt >> SE.Weight >> SE.Real >> SE.SegmentNode;
+            SE.SegmentNode--;
+            if (SE.Tgt >= NumNodes ||
+                (SE.SegmentNode != FunctionEncoding::NoNode &&
+                 SE.SegmentNode >= NumNodes))
+                malformed("invalid successor in " + FE.Name);
+            FE.Edges.push_back(SE);
+        }
+        FE.Offsets.push_back(FE.Edges.size());
+
+        NS >> NumLocs;
+        for (uint32_t I = 0; I < NumLocs; I++) {
+            FunctionEncoding::Location L = {0, 0};
+            NS >> L.File >> L.Line;
+            if (L.File >= NumFiles)
+                malformed("invalid file in " + FE.Name);
+            FE.Locs.push_back(L);
+        }
+        FE.LocOffsets.push_back(FE.Locs.size());
+        if (NS.fail())
+            malformed("invalid node in " + FE.Name);
+        NS >> ws;
+        getline(NS, FE.BlockNames[N]);
+    }
+
+    FE.LoopHeaders.resize(NumLoops);
+    for (auto &Header : FE.LoopHeaders)
+        getline(In, Header);
+
+    FE.finalize();
+    return true;
+}
+
+EncodingMap epp::readEncodingFile(StringRef Filename,
+                                  const DenseSet<uint64_t> *Wanted) {
+    ifstream EncFile(Filename.str(), ios::in);
+    if (!EncFile.is_open())
+        report_fatal_error("Could not open encoding file " + Filename);
+
+    EncodingMap Encodings;
+    auto FE = llvm::make_unique<FunctionEncoding>();
+    while (readFunctionEncoding(EncFile, *FE, Wanted)) {
+        auto GUID       = FE->GUID;
+        Encodings[GUID] = std::move(FE);
+        FE              = llvm::make_unique<FunctionEncoding>();
+    }
+    return Encodings;
+}
+
+void epp::appendEncodingFile(StringRef Filename, StringRef Encodings) {
+    error_code EC;
+    raw_fd_ostream EncFile(Filename, EC, sys::fs::F_Append | sys::fs::F_Text);
+    if (EC) {
+        report_fatal_error("error saving encodings to '" + Filename +
+                           "': \n" + EC.message());
+    }
+    EncFile.SetUnbuffered();
+    EncFile << Encodings;
+}
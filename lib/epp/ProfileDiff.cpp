@@ -0,0 +1,226 @@
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/Format.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "ProfileDiff.h"
+#include "ProfileReader.h"
+
+using namespace llvm;
+using namespace epp;
+using namespace std;
+
+namespace {
+
+/// The path sections of a profile, one function at a time. The function
+/// table comes first, so it is complete once the first section is read.
+struct PathStream {
+    string Filename;
+    unique_ptr<ProfileReader> Reader;
+    ProfileSection Header;
+    DenseMap<uint64_t, ProfileSection> Table;
+    bool Valid = false;
+
+    explicit PathStream(StringRef F)
+        : Filename(F.str()), Reader(ProfileReader::open(F)) {
+        next();
+    }
+
+    void next() {
+        bool First = !Valid;
+        auto Prev  = Header.GUID;
+        while ((Valid = Reader->next(Header))) {
+            switch (Header.Kind) {
+            case ProfileSection::FunctionEntry:
+                Table[Header.GUID] = Header;
+                break;
+            case ProfileSection::Paths:
+                if (!Table.count(Header.GUID) ||
+                    (!First && Header.GUID <= Prev))
+                    report_fatal_error(
+                        "Invalid profile " + Filename + ": paths of " +
+                        utohexstr(Header.GUID) +
+                        " out of order or missing from the function table");
+                return;
+            case ProfileSection::LoopWindows:
+                Reader->skipRecords(Header.NumRecords);
+                break;
+            }
+        }
+    }
+
+    /// Add the frequencies of the current section, the first or second
+    /// of each pair, and move on to the next one.
+    void read(MapVector<uint64_t, pair<uint64_t, uint64_t>> &Freqs,
+              bool IsNew) {
+        for (uint64_t I = 0; I < Header.NumRecords; I++) {
+            uint64_t Id, Freq;
+            Reader->readPath(Id, Freq);
+            auto &Pair = Freqs[Id];
+            (IsNew ? Pair.second : Pair.first) += Freq;
+        }
+        next();
+    }
+};
+
+struct FunctionChange {
+    uint64_t GUID;
+    StringRef Name;
+    const FunctionEncoding *FE;
+    uint64_t Old = 0, New = 0;
+    unsigned ChangedPaths = 0, NewPaths = 0, VanishedPaths = 0;
+    bool CFGChanged = false;
+};
+
+struct PathChange {
+    const FunctionChange *Function;
+    uint64_t Id;
+    uint64_t Old, New;
+
+    uint64_t absolute() const { return Old > New ? Old - New : New - Old; }
+    /// A new path has changed infinitely.
+    double relative() const {
+        return Old ? double(absolute()) / Old
+                   : numeric_limits<double>::infinity();
+    }
+};
+
+int64_t delta(uint64_t Old, uint64_t New) { return int64_t(New - Old); }
+
+void printRelative(raw_ostream &OS, const PathChange &C) {
+    if (C.Old == 0)
+        OS << "new";
+    else if (C.New == 0)
+        OS << "vanished";
+    else
+        OS << format("%+.1f%%", 100.0 * delta(C.Old, C.New) / C.Old);
+}
+}
+
+/// Only the encodings of functions which match the table of the new
+/// profile, or of the old one for a function which is no longer executed,
+/// are used to decode paths.
+void ProfileDiff::print(StringRef OldProfile, StringRef NewProfile,
+                        raw_ostream &OS) {
+    PathStream Old(OldProfile), New(NewProfile);
+    vector<unique_ptr<FunctionChange>> Functions;
+    vector<PathChange> Paths;
+
+    MapVector<uint64_t, pair<uint64_t, uint64_t>> Freqs;
+    while (Old.Valid || New.Valid) {
+        uint64_t GUID = !Old.Valid ? New.Header.GUID
+                                   : !New.Valid ? Old.Header.GUID
+                                                : min(Old.Header.GUID,
+                                                      New.Header.GUID);
+        Freqs.clear();
+        if (Old.Valid && Old.Header.GUID == GUID)
+            Old.read(Freqs, false);
+        if (New.Valid && New.Header.GUID == GUID)
+            New.read(Freqs, true);
+
+        auto OldEntry = Old.Table.find(GUID);
+        auto NewEntry = New.Table.find(GUID);
+        auto FC       = llvm::make_unique<FunctionChange>();
+        FC->GUID      = GUID;
+        auto &Entry   = NewEntry != New.Table.end() ? NewEntry->second
+                                                    : OldEntry->second;
+        FC->Name = Entry.Name;
+        FC->FE   = Lookup(GUID);
+        if (FC->FE && (FC->FE->NumPaths != Entry.NumPaths ||
+                       FC->FE->CFGHash != Entry.CFGHash))
+            FC->FE = nullptr;
+        FC->CFGChanged = OldEntry != Old.Table.end() &&
+                         NewEntry != New.Table.end() &&
+                         (OldEntry->second.NumPaths != Entry.NumPaths ||
+                          OldEntry->second.CFGHash != Entry.CFGHash);
+
+        for (auto &KV : Freqs) {
+            FC->Old += KV.second.first;
+            FC->New += KV.second.second;
+            if (FC->CFGChanged || KV.second.first == KV.second.second)
+                continue;
+            FC->ChangedPaths++;
+            FC->NewPaths += KV.second.first == 0;
+            FC->VanishedPaths += KV.second.second == 0;
+            Paths.push_back(
+                {FC.get(), KV.first, KV.second.first, KV.second.second});
+        }
+        if (FC->CFGChanged || FC->ChangedPaths > 0)
+            Functions.push_back(std::move(FC));
+    }
+
+    stable_sort(Functions.begin(), Functions.end(),
+                [](const unique_ptr<FunctionChange> &A,
+                   const unique_ptr<FunctionChange> &B) {
+                    auto DA = delta(A->Old, A->New), DB = delta(B->Old, B->New);
+                    return std::abs(DA) > std::abs(DB);
+                });
+    auto ByAbsolute = [](const PathChange &A, const PathChange &B) {
+        return A.absolute() > B.absolute();
+    };
+    auto ByRelative = [](const PathChange &A, const PathChange &B) {
+        return A.relative() > B.relative() ||
+               (A.relative() == B.relative() && A.absolute() > B.absolute());
+    };
+    if (Ranking == AbsoluteChange)
+        stable_sort(Paths.begin(), Paths.end(), ByAbsolute);
+    else
+        stable_sort(Paths.begin(), Paths.end(), ByRelative);
+    if (Top > 0 && Paths.size() > Top)
+        Paths.resize(Top);
+
+    // Decode the listed paths of each function at once.
+    DenseMap<const FunctionChange *, vector<uint32_t>> Listed;
+    for (uint32_t I = 0; I < Paths.size(); I++) {
+        auto *FE = Paths[I].Function->FE;
+        if (FE && Paths[I].Id < FE->NumPaths)
+            Listed[Paths[I].Function].push_back(I);
+    }
+    vector<FunctionEncoding::NodePath> Decoded(Paths.size());
+    for (auto &KV : Listed) {
+        vector<uint64_t> Ids;
+        for (auto I : KV.second)
+            Ids.push_back(Paths[I].Id);
+        auto NodePaths = KV.first->FE->decode(Ids);
+        for (uint32_t J = 0; J < KV.second.size(); J++)
+            Decoded[KV.second[J]] = std::move(NodePaths[J]);
+    }
+
+    OS << "# Function Changes\n";
+    for (auto &FC : Functions) {
+        OS << "- name: " << FC->Name << "\n";
+        OS << "  old_freq: " << FC->Old << "\n";
+        OS << "  new_freq: " << FC->New << "\n";
+        OS << "  delta: " << delta(FC->Old, FC->New) << "\n";
+        if (FC->CFGChanged) {
+            OS << "  cfg_changed: true\n";
+            continue;
+        }
+        OS << "  changed_paths: " << FC->ChangedPaths << "\n";
+        OS << "  new_paths: " << FC->NewPaths << "\n";
+        OS << "  vanished_paths: " << FC->VanishedPaths << "\n";
+    }
+
+    OS << "# Path Changes\n";
+    for (uint32_t I = 0; I < Paths.size(); I++) {
+        auto &C = Paths[I];
+        OS << "- name: " << C.Function->Name << "\n";
+        OS << "  path: " << utohexstr(C.Id) << "\n";
+        OS << "  old_freq: " << C.Old << "\n";
+        OS << "  new_freq: " << C.New << "\n";
+        OS << "  delta: " << delta(C.Old, C.New) << "\n";
+        OS << "  change: ";
+        printRelative(OS, C);
+        OS << "\n";
+        if (!Decoded[I].Nodes.empty())
+            C.Function->FE->printPathSrc(Decoded[I].Nodes, OS, "    ");
+    }
+}
@@ -0,0 +1,243 @@
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/ThreadPool.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <map>
+#include <memory>
+#include <queue>
+#include <tuple>
+#include <vector>
+
+#include "ProfileMerger.h"
+#include "ProfileReader.h"
+
+using namespace llvm;
+using namespace epp;
+using namespace std;
+
+namespace {
+
+struct MergeInput {
+    string Filename;
+    uint64_t Weight;
+    unique_ptr<ProfileReader> Reader;
+    ProfileSection Header;
+};
+
+typedef tuple<unsigned, uint64_t, uint32_t> SectionKey;
+
+/// Where the sections of a function were written.
+struct IndexEntry {
+    uint64_t Entry = 0, EntryLength = 0, Paths = 0, PathsLength = 0,
+             Loops = 0, LoopsLength = 0;
+    string Name;
+};
+
+/// The function table, the path sections and the loop sections follow
+/// each other in every profile, so sections are ordered by their kind
+/// first, then by function and loop.
+SectionKey getKey(const ProfileSection &S) {
+    return make_tuple(S.Kind, S.GUID, S.LoopId);
+}
+
+bool advance(MergeInput &In) {
+    auto Prev = getKey(In.Header);
+    if (!In.Reader->next(In.Header))
+        return false;
+    if (getKey(In.Header) <= Prev)
+        report_fatal_error("Invalid profile " + In.Filename +
+                           ": sections are not sorted by function");
+    return true;
+}
+
+void mergeFunctionEntries(ArrayRef<MergeInput *> Same, raw_ostream &OS) {
+    auto &S = Same[0]->Header;
+    for (auto *In : Same) {
+        if (In->Header.NumPaths != S.NumPaths ||
+            In->Header.CFGHash != S.CFGHash)
+            report_fatal_error("Cannot merge the profiles of different "
+                               "versions of function " +
+                               S.Name + " in " + Same[0]->Filename +
+                               " and " + In->Filename);
+    }
+    OS << "function " << format_hex_no_prefix(S.GUID, 16) << " " << S.NumPaths
+       << " " << format_hex_no_prefix(S.CFGHash, 16) << " " << S.Name << "\n";
+}
+
+/// Paths are written by decreasing frequency as the runtime does, ties
+/// broken by decreasing id.
+void mergePaths(ArrayRef<MergeInput *> Same, raw_ostream &OS) {
+    DenseMap<uint64_t, uint64_t> Freqs;
+    for (auto *In : Same) {
+        for (uint64_t I = 0; I < In->Header.NumRecords; I++) {
+            uint64_t Id, Freq;
+            In->Reader->readPath(Id, Freq);
+            auto &Total = Freqs[Id];
+            Total       = SaturatingMultiplyAdd(Freq, In->Weight, Total);
+        }
+    }
+
+    vector<pair<uint64_t, uint64_t>> Records(Freqs.begin(), Freqs.end());
+    sort(Records.begin(), Records.end(),
+         [](const pair<uint64_t, uint64_t> &A,
+            const pair<uint64_t, uint64_t> &B) {
+             return A.second > B.second ||
+                    (A.second == B.second && A.first > B.first);
+         });
+    OS << format_hex_no_prefix(Same[0]->Header.GUID, 16) << " "
+       << Records.size() << "\n";
+    for (auto &R : Records)
+        OS << format_hex_no_prefix(R.first, 16) << " " << R.second << "\n";
+}
+
+void mergeLoopWindows(ArrayRef<MergeInput *> Same, raw_ostream &OS) {
+    auto &S = Same[0]->Header;
+    map<vector<uint64_t>, uint64_t> Freqs;
+    vector<uint64_t> Window(S.K);
+    for (auto *In : Same) {
+        if (In->Header.K != S.K)
+            report_fatal_error("Cannot merge loop windows of different sizes "
+                               "in " +
+                               Same[0]->Filename + " and " + In->Filename);
+        for (uint64_t I = 0; I < In->Header.NumRecords; I++) {
+            uint64_t Freq;
+            In->Reader->readWindow(MutableArrayRef<uint64_t>(Window), Freq);
+            auto &Total = Freqs[Window];
+            Total       = SaturatingMultiplyAdd(Freq, In->Weight, Total);
+        }
+    }
+
+    vector<pair<vector<uint64_t>, uint64_t>> Records(Freqs.begin(),
+                                                     Freqs.end());
+    stable_sort(Records.begin(), Records.end(),
+                [](const pair<vector<uint64_t>, uint64_t> &A,
+                   const pair<vector<uint64_t>, uint64_t> &B) {
+                    return A.second > B.second;
+                });
+    OS << "loop " << format_hex_no_prefix(S.GUID, 16) << " " << S.LoopId
+       << " " << S.K << " " << Records.size() << "\n";
+    for (auto &R : Records) {
+        for (auto Id : R.first)
+            OS << format_hex_no_prefix(Id, 16) << " ";
+        OS << R.second << "\n";
+    }
+}
+
+/// The index follows the sections as the runtime writes it, its offset
+/// on the last line with a fixed width.
+void writeIndex(const map<uint64_t, IndexEntry> &Index, raw_ostream &OS) {
+    uint64_t Offset = OS.tell();
+    OS << "index " << Index.size() << "\n";
+    for (auto &KV : Index) {
+        auto &E = KV.second;
+        OS << format_hex_no_prefix(KV.first, 16) << " " << E.Entry << " "
+           << E.EntryLength << " " << E.Paths << " " << E.PathsLength << " "
+           << E.Loops << " " << E.LoopsLength << " " << E.Name << "\n";
+    }
+    OS << "index-offset " << format("%020" PRIu64, Offset) << "\n";
+}
+
+/// Repeatedly take the smallest section left among the inputs, together
+/// with the sections of the other inputs with the same key.
+void mergeStreams(ArrayRef<WeightedProfile> Profiles, raw_ostream &OS) {
+    vector<MergeInput> Inputs(Profiles.size());
+    auto Greater = [&Inputs](unsigned A, unsigned B) {
+        return getKey(Inputs[A].Header) > getKey(Inputs[B].Header);
+    };
+    priority_queue<unsigned, vector<unsigned>, decltype(Greater)> Heap(
+        Greater);
+    for (unsigned I = 0; I < Profiles.size(); I++) {
+        Inputs[I].Filename = Profiles[I].Filename;
+        Inputs[I].Weight   = Profiles[I].Weight;
+        Inputs[I].Reader   = ProfileReader::open(Profiles[I].Filename);
+        if (Inputs[I].Reader->next(Inputs[I].Header))
+            Heap.push(I);
+    }
+
+    SmallVector<MergeInput *, 8> Same;
+    map<uint64_t, IndexEntry> Index;
+    while (!Heap.empty()) {
+        Same.clear();
+        auto Key = getKey(Inputs[Heap.top()].Header);
+        while (!Heap.empty() && getKey(Inputs[Heap.top()].Header) == Key) {
+            Same.push_back(&Inputs[Heap.top()]);
+            Heap.pop();
+        }
+
+        uint64_t Begin = OS.tell();
+        auto &E        = Index[Same[0]->Header.GUID];
+        switch (Same[0]->Header.Kind) {
+        case ProfileSection::FunctionEntry:
+            mergeFunctionEntries(Same, OS);
+            E.Entry       = Begin;
+            E.EntryLength = OS.tell() - Begin;
+            E.Name        = Same[0]->Header.Name.str();
+            break;
+        case ProfileSection::Paths:
+            mergePaths(Same, OS);
+            E.Paths       = Begin;
+            E.PathsLength = OS.tell() - Begin;
+            break;
+        case ProfileSection::LoopWindows:
+            mergeLoopWindows(Same, OS);
+            if (E.LoopsLength == 0)
+                E.Loops = Begin;
+            E.LoopsLength += OS.tell() - Begin;
+            break;
+        }
+
+        for (auto *In : Same) {
+            if (advance(*In))
+                Heap.push(In - Inputs.data());
+        }
+    }
+    writeIndex(Index, OS);
+}
+}
+
+void epp::mergeProfiles(ArrayRef<WeightedProfile> Inputs, raw_ostream &OS,
+                        unsigned Jobs) {
+    if (Jobs <= 1 || Inputs.size() <= Jobs) {
+        mergeStreams(Inputs, OS);
+        return;
+    }
+
+    // Each job merges a slice of the inputs, the weights are applied then.
+    size_t SliceSize = (Inputs.size() + Jobs - 1) / Jobs;
+    vector<WeightedProfile> Partial;
+    vector<int> FDs;
+    for (size_t Begin = 0; Begin < Inputs.size(); Begin += SliceSize) {
+        SmallString<128> Path;
+        int FD;
+        if (auto EC = sys::fs::createTemporaryFile("epp-merge", "txt", FD,
+                                                   Path))
+            report_fatal_error("Could not create a temporary profile: " +
+                               EC.message());
+        Partial.push_back({Path.str().str(), 1});
+        FDs.push_back(FD);
+    }
+
+    {
+        ThreadPool Pool(Jobs);
+        for (unsigned I = 0; I < Partial.size(); I++) {
+            auto Slice = Inputs.slice(I * SliceSize);
+            Slice      = Slice.take_front(min(SliceSize, Slice.size()));
+            Pool.async([Slice, &FDs, I]() {
+                raw_fd_ostream Out(FDs[I], true);
+                mergeStreams(Slice, Out);
+            });
+        }
+        Pool.wait();
+    }
+
+    mergeStreams(Partial, OS);
+    for (auto &P : Partial)
+        sys::fs::remove(P.Filename);
+}
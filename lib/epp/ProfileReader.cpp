@@ -0,0 +1,279 @@
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/ErrorOr.h"
+
+#include "ProfileReader.h"
+
+using namespace llvm;
+using namespace epp;
+using namespace std;
+
+namespace {
+
+int hexDigit(char C) {
+    if (C >= '0' && C <= '9')
+        return C - '0';
+    if (C >= 'a' && C <= 'f')
+        return C - 'a' + 10;
+    if (C >= 'A' && C <= 'F')
+        return C - 'A' + 10;
+    return -1;
+}
+}
+
+ProfileReader::ProfileReader(unique_ptr<MemoryBuffer> B, StringRef F)
+    : Buffer(std::move(B)), Filename(F.str()) {
+    Cur = Buffer->getBufferStart();
+    End = Buffer->getBufferEnd();
+}
+
+/// The buffer does not need a null terminator, so that large profiles
+/// are always mapped instead of copied.
+unique_ptr<ProfileReader> ProfileReader::open(StringRef Filename) {
+    auto BufferOrErr = MemoryBuffer::getFile(Filename, -1, false);
+    if (!BufferOrErr)
+        report_fatal_error("Could not open profile " + Filename + ": " +
+                           BufferOrErr.getError().message());
+    return unique_ptr<ProfileReader>(
+        new ProfileReader(std::move(*BufferOrErr), Filename));
+}
+
+void ProfileReader::error(const Twine &Msg) const {
+    if (LineNo == 0)
+        report_fatal_error("Invalid profile " + Filename + " at offset " +
+                           Twine(Cur - Buffer->getBufferStart()) + ": " +
+                           Msg);
+    report_fatal_error("Invalid profile " + Filename + ":" + Twine(LineNo) +
+                       ": " + Msg);
+}
+
+void ProfileReader::skipSpaces() {
+    while (Cur != End && (*Cur == ' ' || *Cur == '\t'))
+        Cur++;
+}
+
+/// Consume Token if the current line continues with it.
+bool ProfileReader::consume(StringRef Token) {
+    if (StringRef(Cur, End - Cur).startswith(Token)) {
+        Cur += Token.size();
+        return true;
+    }
+    return false;
+}
+
+uint64_t ProfileReader::readHex() {
+    skipSpaces();
+    uint64_t Value = 0;
+    const char *Begin = Cur;
+    int Digit;
+    while (Cur != End && (Digit = hexDigit(*Cur)) >= 0) {
+        if (Cur - Begin == 16)
+            error("hexadecimal number out of range");
+        Value = Value << 4 | Digit;
+        Cur++;
+    }
+    if (Cur == Begin)
+        error("expected a hexadecimal number");
+    return Value;
+}
+
+uint64_t ProfileReader::readDecimal() {
+    skipSpaces();
+    uint64_t Value = 0;
+    const char *Begin = Cur;
+    while (Cur != End && *Cur >= '0' && *Cur <= '9') {
+        if (__builtin_mul_overflow(Value, 10, &Value) ||
+            __builtin_add_overflow(Value, *Cur - '0', &Value))
+            error("decimal number out of range");
+        Cur++;
+    }
+    if (Cur == Begin)
+        error("expected a decimal number");
+    return Value;
+}
+
+/// Read up to the end of the line, which is consumed as well.
+StringRef ProfileReader::readRestOfLine() {
+    skipSpaces();
+    const char *Begin = Cur;
+    while (Cur != End && *Cur != '\n')
+        Cur++;
+    StringRef Rest(Begin, Cur - Begin);
+    endLine();
+    return Rest.rtrim("\r");
+}
+
+void ProfileReader::endLine() {
+    skipSpaces();
+    if (Cur != End && *Cur == '\r')
+        Cur++;
+    if (Cur == End)
+        return;
+    if (*Cur != '\n')
+        error("unexpected '" + Twine(*Cur) + "'");
+    Cur++;
+    if (LineNo)
+        LineNo++;
+}
+
+bool ProfileReader::next(ProfileSection &S) {
+    while (Cur == End && !Ranges.empty()) {
+        Cur = Buffer->getBufferStart() + Ranges.front().first;
+        End = Cur + Ranges.front().second;
+        Ranges.erase(Ranges.begin());
+    }
+    if (Cur == End || consume("index ")) {
+        Cur = End;
+        return false;
+    }
+
+    S = ProfileSection();
+    if (consume("function ")) {
+        S.Kind     = ProfileSection::FunctionEntry;
+        S.GUID     = readHex();
+        S.NumPaths = readDecimal();
+        S.CFGHash  = readHex();
+        S.Name     = readRestOfLine();
+        if (S.Name.empty())
+            error("expected a function name");
+        return true;
+    }
+
+    if (consume("loop ")) {
+        S.Kind  = ProfileSection::LoopWindows;
+        S.GUID  = readHex();
+        auto Id = readDecimal();
+        auto K  = readDecimal();
+        if (Id > UINT32_MAX || K == 0 || K > UINT32_MAX)
+            error("invalid loop id or window size");
+        S.LoopId     = Id;
+        S.K          = K;
+        S.NumRecords = readDecimal();
+        endLine();
+        return true;
+    }
+
+    S.Kind       = ProfileSection::Paths;
+    S.GUID       = readHex();
+    S.NumRecords = readDecimal();
+    endLine();
+    return true;
+}
+
+void ProfileReader::readPath(uint64_t &PathId, uint64_t &Freq) {
+    if (Cur == End)
+        error("missing path records");
+    PathId = readHex();
+    Freq   = readDecimal();
+    endLine();
+}
+
+void ProfileReader::readWindow(MutableArrayRef<uint64_t> PathIds,
+                               uint64_t &Freq) {
+    if (Cur == End)
+        error("missing loop windows");
+    for (auto &PathId : PathIds)
+        PathId = readHex();
+    Freq = readDecimal();
+    endLine();
+}
+
+void ProfileReader::skipRecords(uint64_t NumRecords) {
+    for (uint64_t I = 0; I < NumRecords; I++) {
+        if (Cur == End)
+            error("missing records");
+        while (Cur != End && *Cur != '\n')
+            Cur++;
+        if (Cur != End)
+            Cur++;
+        if (LineNo)
+            LineNo++;
+    }
+}
+
+/// The index follows the sections:
+///
+///   index <number of functions>
+///   <guid> <entry offset> <length> <paths offset> <length> <loops offset>
+///       <length> <name>
+///   index-offset <offset of the index line, 20 digits>
+///
+/// The last line has a fixed width, so that the index is found without
+/// reading the rest of the profile.
+bool ProfileReader::readIndex(vector<ProfileIndexEntry> &Index) {
+    const size_t TrailerSize = 34;
+    StringRef Buf            = Buffer->getBuffer();
+    if (Buf.size() < TrailerSize ||
+        !Buf.substr(Buf.size() - TrailerSize).startswith("index-offset "))
+        return false;
+
+    uint64_t Offset;
+    StringRef Digits = Buf.substr(Buf.size() - TrailerSize + 13, 20);
+    if (Digits.getAsInteger(10, Offset) || Offset >= Buf.size() - TrailerSize)
+        error("invalid index offset");
+
+    auto SavedCur = Cur, SavedEnd = End;
+    auto SavedLineNo = LineNo;
+    Cur    = Buf.data() + Offset;
+    End    = Buf.data() + Buf.size() - TrailerSize;
+    LineNo = 0;
+    if (!consume("index "))
+        error("expected the index");
+    auto NumEntries = readDecimal();
+    endLine();
+
+    Index.clear();
+    for (uint64_t I = 0; I < NumEntries; I++) {
+        if (Cur == End)
+            error("missing index entries");
+        ProfileIndexEntry E;
+        E.GUID        = readHex();
+        E.EntryOffset = readDecimal();
+        E.EntryLength = readDecimal();
+        E.PathsOffset = readDecimal();
+        E.PathsLength = readDecimal();
+        E.LoopsOffset = readDecimal();
+        E.LoopsLength = readDecimal();
+        E.Name        = readRestOfLine();
+        if (E.EntryOffset + E.EntryLength > Offset ||
+            E.PathsOffset + E.PathsLength > Offset ||
+            E.LoopsOffset + E.LoopsLength > Offset)
+            error("index entry out of range");
+        Index.push_back(E);
+    }
+
+    Cur    = SavedCur;
+    End    = SavedEnd;
+    LineNo = SavedLineNo;
+    return true;
+}
+
+void ProfileReader::restrict(ArrayRef<pair<uint64_t, uint64_t>> ByteRanges) {
+    Ranges.assign(ByteRanges.begin(), ByteRanges.end());
+    Cur = End = Buffer->getBufferStart();
+    LineNo    = 0;
+}
+
+/// A profile without a function table lists its functions in the path
+/// sections, which are all read then.
+DenseSet<uint64_t> epp::getProfiledFunctions(StringRef Filename) {
+    auto Reader = ProfileReader::open(Filename);
+    DenseSet<uint64_t> GUIDs;
+    vector<ProfileIndexEntry> Index;
+    if (Reader->readIndex(Index)) {
+        for (auto &E : Index)
+            GUIDs.insert(E.GUID);
+        return GUIDs;
+    }
+
+    ProfileSection S;
+    bool HasTable = false;
+    while (Reader->next(S)) {
+        if (S.Kind == ProfileSection::FunctionEntry)
+            HasTable = true;
+        else if (HasTable)
+            break;
+        GUIDs.insert(S.GUID);
+        Reader->skipRecords(S.NumRecords);
+    }
+    return GUIDs;
+}
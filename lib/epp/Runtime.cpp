@@ -1,21 +1,74 @@
 #include <algorithm>
+#include <array>
+#include <cerrno>
 #include <cinttypes>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <list>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <set>
+#include <string>
 #include <thread>
+#include <tuple>
 #include <unordered_map>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
 using namespace std;
 
 #define EPP(X) __epp_##X
 
-extern uint32_t EPP(numberOfFunctions);
+// Layout of the function table emitted by the EPPProfile pass.
+struct FunctionTableEntry {
+    uint64_t GUID;
+    uint64_t NumPaths;
+    uint64_t CFGHash;
+    const char *Name;
+};
+
+// The instrumented functions, indexed by the dense id the functions log
+// their paths with. The constructor of every instrumented module appends
+// its table, and the functions of the module log their index plus the
+// number of functions registered before.
+vector<FunctionTableEntry> FunctionTable;
+// Number of modules whose destructor has not saved the profile yet.
+uint32_t NumberOfModules = 0;
+
+// The longest window the instrumentation records, -k is checked against
+// it. Must match MaxLoopIterations in EPPProfile.h.
+const uint32_t MaxLoopIterations = 16;
 
-typedef vector<unordered_map<uint64_t, uint64_t>> TLSDataTy;
+// A window of K consecutive iteration paths of a loop, the ids past K are
+// zero. A fixed size key is counted without allocating on every iteration.
+typedef array<uint64_t, MaxLoopIterations> WindowTy;
+
+struct WindowHash {
+    size_t operator()(const WindowTy &W) const {
+        uint64_t H = 0;
+        for (auto Id : W)
+            H = (H ^ Id) * 0x9e3779b97f4a7c15ULL;
+        return H ^ (H >> 32);
+    }
+};
+
+struct LoopWindowsTy {
+    uint32_t K = 0;
+    unordered_map<WindowTy, uint64_t, WindowHash> Counts;
+};
+
+struct TLSDataTy {
+    vector<unordered_map<uint64_t, uint64_t>> Paths;
+    // Indexed by the function id, then by the loop id.
+    vector<vector<LoopWindowsTy>> Loops;
+};
 list<shared_ptr<TLSDataTy>> GlobalEPPDataList;
 
 mutex tlsMutex;
@@ -26,7 +79,23 @@ class EPP(data) {
   public:
     void log(uint64_t Val, uint64_t FunctionId) {
         // cout << "log " << tid << " " << Val << " " << FunctionId << endl;
-        (*Ptr)[FunctionId][Val] += 1;
+        // A module loaded after this thread started adds functions.
+        if (FunctionId >= Ptr->Paths.size())
+            Ptr->Paths.resize(FunctionId + 1);
+        Ptr->Paths[FunctionId][Val] += 1;
+    }
+
+    void logLoop(const uint64_t *Window, uint32_t K, uint64_t FunctionId,
+                 uint32_t LoopId) {
+        if (FunctionId >= Ptr->Loops.size())
+            Ptr->Loops.resize(FunctionId + 1);
+        auto &Loops = Ptr->Loops[FunctionId];
+        if (LoopId >= Loops.size())
+            Loops.resize(LoopId + 1);
+        WindowTy Key{};
+        copy(Window, Window + K, Key.begin());
+        Loops[LoopId].K = K;
+        Loops[LoopId].Counts[Key] += 1;
     }
 
     EPP(data)() {
@@ -36,7 +105,7 @@ class EPP(data) {
         // Allocate an unordered_map for each function even though we know it
         // may not
         // be used. This is to make the lookup faster at runtime.
-        Ptr->resize(EPP(numberOfFunctions));
+        Ptr->Paths.resize(FunctionTable.size());
     }
 };
 
@@ -45,53 +114,460 @@ class EPP(data) {
 
 thread_local unique_ptr<EPP(data)> Data = make_unique<EPP(data)>();
 
+// A section of the profile: an entry of the function table, the paths of
+// a function, or the windows of a loop. Every record holds K path ids, a
+// path record is a window of one path.
+struct Section {
+    enum KindTy { FunctionEntry, Paths, LoopWindows };
+
+    KindTy Kind;
+    uint64_t GUID     = 0;
+    uint32_t LoopId   = 0;
+    uint64_t NumPaths = 0;
+    uint64_t CFGHash  = 0;
+    string Name;
+    size_t K = 1;
+    vector<uint64_t> Ids;
+    vector<uint64_t> Freqs;
+
+    // The sections of a profile are sorted by this key.
+    tuple<int, uint64_t, uint32_t> key() const {
+        return make_tuple(Kind, GUID, LoopId);
+    }
+};
+
+// Paths are sorted by decreasing frequency, then decreasing id.
+void setPaths(Section &S, const unordered_map<uint64_t, uint64_t> &Paths) {
+    vector<pair<uint64_t, uint64_t>> Values(Paths.begin(), Paths.end());
+    sort(Values.begin(), Values.end(),
+         [](const pair<uint64_t, uint64_t> &P1,
+            const pair<uint64_t, uint64_t> &P2) {
+             return (P1.second > P2.second) ||
+                    (P1.second == P2.second && P1.first > P2.first);
+         });
+    S.Ids.clear();
+    S.Freqs.clear();
+    for (auto &KV : Values) {
+        S.Ids.push_back(KV.first);
+        S.Freqs.push_back(KV.second);
+    }
+}
+
+// Windows are sorted by decreasing frequency, then by their paths.
+void setWindows(Section &S, const map<vector<uint64_t>, uint64_t> &Windows) {
+    vector<pair<vector<uint64_t>, uint64_t>> Values(Windows.begin(),
+                                                    Windows.end());
+    stable_sort(Values.begin(), Values.end(),
+                [](const pair<vector<uint64_t>, uint64_t> &P1,
+                   const pair<vector<uint64_t>, uint64_t> &P2) {
+                    return P1.second > P2.second;
+                });
+    S.Ids.clear();
+    S.Freqs.clear();
+    for (auto &KV : Values) {
+        S.Ids.insert(S.Ids.end(), KV.first.begin(), KV.first.end());
+        S.Freqs.push_back(KV.second);
+    }
+}
+
+// Add the records of Other to those of S, which has the same key.
+void addRecords(Section &S, const Section &Other) {
+    const Section &Own = S;
+    if (S.Kind == Section::Paths) {
+        unordered_map<uint64_t, uint64_t> Paths;
+        for (auto *From : {&Own, &Other}) {
+            for (size_t I = 0; I < From->Freqs.size(); I++)
+                Paths[From->Ids[I]] += From->Freqs[I];
+        }
+        setPaths(S, Paths);
+    } else {
+        map<vector<uint64_t>, uint64_t> Windows;
+        for (auto *From : {&Own, &Other}) {
+            for (size_t I = 0; I < From->Freqs.size(); I++) {
+                auto Begin = From->Ids.begin() + I * From->K;
+                Windows[vector<uint64_t>(Begin, Begin + From->K)] +=
+                    From->Freqs[I];
+            }
+        }
+        setWindows(S, Windows);
+    }
+}
+
+void writeSection(FILE *fp, const Section &S) {
+    switch (S.Kind) {
+    case Section::FunctionEntry:
+        fprintf(fp, "function %016" PRIx64 " %" PRIu64 " %016" PRIx64 " %s\n",
+                S.GUID, S.NumPaths, S.CFGHash, S.Name.c_str());
+        return;
+    case Section::Paths:
+        fprintf(fp, "%016" PRIx64 " %zu\n", S.GUID, S.Freqs.size());
+        break;
+    case Section::LoopWindows:
+        fprintf(fp, "loop %016" PRIx64 " %u %zu %zu\n", S.GUID, S.LoopId, S.K,
+                S.Freqs.size());
+        break;
+    }
+    for (size_t I = 0; I < S.Freqs.size(); I++) {
+        for (size_t J = 0; J < S.K; J++)
+            fprintf(fp, "%016" PRIx64 " ", S.Ids[I * S.K + J]);
+        fprintf(fp, "%" PRIu64 "\n", S.Freqs[I]);
+    }
+}
+
+// Writes the sections of a profile and the index after them, which gives
+// the byte ranges of the table entry, path section and loop sections of
+// every function, so that tools can read a single function of a large
+// profile. The last line holds the offset of the index with a fixed width.
+class ProfileWriter {
+    struct IndexEntry {
+        long Entry = 0, EntryLength = 0, Paths = 0, PathsLength = 0,
+             Loops = 0, LoopsLength = 0;
+        string Name;
+    };
+
+    FILE *fp;
+    map<uint64_t, IndexEntry> Index;
+
+  public:
+    ProfileWriter(FILE *F) : fp(F) {}
+
+    void write(const Section &S) {
+        long Begin = ftell(fp);
+        writeSection(fp, S);
+        long Length = ftell(fp) - Begin;
+        auto &E     = Index[S.GUID];
+        switch (S.Kind) {
+        case Section::FunctionEntry:
+            E.Entry       = Begin;
+            E.EntryLength = Length;
+            E.Name        = S.Name;
+            break;
+        case Section::Paths:
+            E.Paths       = Begin;
+            E.PathsLength = Length;
+            break;
+        case Section::LoopWindows:
+            // The loops of a function are adjacent.
+            if (E.LoopsLength == 0)
+                E.Loops = Begin;
+            E.LoopsLength += Length;
+            break;
+        }
+    }
+
+    void finish() {
+        long Offset = ftell(fp);
+        fprintf(fp, "index %zu\n", Index.size());
+        for (auto &KV : Index) {
+            auto &E = KV.second;
+            fprintf(fp, "%016" PRIx64 " %ld %ld %ld %ld %ld %ld %s\n",
+                    KV.first, E.Entry, E.EntryLength, E.Paths, E.PathsLength,
+                    E.Loops, E.LoopsLength, E.Name.c_str());
+        }
+        fprintf(fp, "index-offset %020ld\n", Offset);
+    }
+};
+
+// Reads the sections of a profile one at a time.
+class SectionReader {
+    FILE *fp;
+    char *Line = nullptr;
+    size_t Capacity = 0;
+
+    bool readLine() { return getline(&Line, &Capacity, fp) > 0; }
+
+  public:
+    SectionReader(FILE *F) : fp(F) {}
+    ~SectionReader() { free(Line); }
+
+    // Returns false at the end of the sections, or if the profile is
+    // malformed.
+    bool next(Section &S, bool &Failed) {
+        Failed = false;
+        if (!readLine() || strncmp(Line, "index ", 6) == 0)
+            return false;
+
+        S = Section();
+        uint64_t NumRecords;
+        int Offset;
+        if (sscanf(Line, "function %" SCNx64 " %" SCNu64 " %" SCNx64 " %n",
+                   &S.GUID, &S.NumPaths, &S.CFGHash, &Offset) == 3) {
+            S.Kind = Section::FunctionEntry;
+            S.Name = string(Line + Offset, strcspn(Line + Offset, "\r\n"));
+            Failed = S.Name.empty();
+            return !Failed;
+        }
+        if (sscanf(Line, "loop %" SCNx64 " %" SCNu32 " %zu %" SCNu64,
+                   &S.GUID, &S.LoopId, &S.K, &NumRecords) == 4 &&
+            S.K > 0) {
+            S.Kind = Section::LoopWindows;
+        } else if (sscanf(Line, "%" SCNx64 " %" SCNu64, &S.GUID,
+                          &NumRecords) == 2) {
+            S.Kind = Section::Paths;
+        } else {
+            Failed = true;
+            return false;
+        }
+
+        for (uint64_t I = 0; I < NumRecords; I++) {
+            if (!readLine()) {
+                Failed = true;
+                return false;
+            }
+            char *P = Line, *End;
+            for (size_t J = 0; J <= S.K; J++) {
+                uint64_t Value = strtoull(P, &End, J < S.K ? 16 : 10);
+                if (End == P) {
+                    Failed = true;
+                    return false;
+                }
+                (J < S.K ? S.Ids : S.Freqs).push_back(Value);
+                P = End;
+            }
+        }
+        return true;
+    }
+};
+
+// Merge the sections of the existing profile with those of this process in
+// a single pass, as both are sorted. A function whose CFG changed since the
+// existing profile was written starts over. Returns false if the existing
+// profile is malformed.
+bool mergeSections(FILE *In, const vector<Section> &Ours,
+                   ProfileWriter &Out) {
+    SectionReader Reader(In);
+    Section Theirs;
+    bool Failed;
+    bool HasTheirs = Reader.next(Theirs, Failed);
+    set<uint64_t> Changed;
+    auto It = Ours.begin();
+    while (HasTheirs || It != Ours.end()) {
+        if (!HasTheirs || (It != Ours.end() && It->key() < Theirs.key())) {
+            Out.write(*It++);
+            continue;
+        }
+
+        if (It != Ours.end() && It->key() == Theirs.key()) {
+            if (Theirs.Kind == Section::FunctionEntry) {
+                if (Theirs.NumPaths != It->NumPaths ||
+                    Theirs.CFGHash != It->CFGHash)
+                    Changed.insert(Theirs.GUID);
+                Out.write(*It);
+            } else if (Changed.count(Theirs.GUID) || Theirs.K != It->K) {
+                Out.write(*It);
+            } else {
+                addRecords(Theirs, *It);
+                Out.write(Theirs);
+            }
+            It++;
+        } else if (!Changed.count(Theirs.GUID) ||
+                   Theirs.Kind == Section::FunctionEntry) {
+            Out.write(Theirs);
+        }
+
+        auto Prev = Theirs.key();
+        HasTheirs = Reader.next(Theirs, Failed);
+        if (HasTheirs && Theirs.key() <= Prev)
+            return false;
+    }
+    return !Failed;
+}
+
+// Only one process at a time merges into the profile, the others wait for
+// the lock. The lock is taken on a file of its own, as the profile itself
+// is replaced. The merged profile is written next to the profile and
+// renamed over it, so that a crash never leaves a truncated profile.
+void saveAccumulated(const char *Path, const vector<Section> &Ours) {
+    string LockPath = string(Path) + ".lock";
+    int LockFD      = open(LockPath.c_str(), O_RDWR | O_CREAT, 0644);
+    if (LockFD < 0 || flock(LockFD, LOCK_EX) != 0) {
+        fprintf(stderr, "EPP: could not lock %s: %s\n", LockPath.c_str(),
+                strerror(errno));
+        if (LockFD >= 0)
+            close(LockFD);
+        return;
+    }
+
+    string TmpPath = string(Path) + ".tmp." + to_string(getpid());
+    FILE *Out      = fopen(TmpPath.c_str(), "w");
+    if (!Out) {
+        fprintf(stderr, "EPP: could not write %s: %s\n", TmpPath.c_str(),
+                strerror(errno));
+        close(LockFD);
+        return;
+    }
+
+    bool Merged = true;
+    ProfileWriter Writer(Out);
+    if (FILE *In = fopen(Path, "r")) {
+        Merged = mergeSections(In, Ours, Writer);
+        fclose(In);
+    } else {
+        for (auto &S : Ours)
+            Writer.write(S);
+    }
+    Writer.finish();
+    bool Written = fflush(Out) == 0 && fsync(fileno(Out)) == 0;
+    Written      = fclose(Out) == 0 && Written;
+
+    if (Merged && Written && rename(TmpPath.c_str(), Path) == 0) {
+        close(LockFD);
+        return;
+    }
+
+    // Keep the existing profile, and the counts of this process apart.
+    unlink(TmpPath.c_str());
+    string OwnPath = string(Path) + "." + to_string(getpid());
+    fprintf(stderr, "EPP: could not merge into %s, saving to %s\n", Path,
+            OwnPath.c_str());
+    if (FILE *Own = fopen(OwnPath.c_str(), "w")) {
+        ProfileWriter Writer(Own);
+        for (auto &S : Ours)
+            Writer.write(S);
+        Writer.finish();
+        fclose(Own);
+    }
+    close(LockFD);
+}
+
 extern "C" {
 
-void EPP(init)() {}
+/// Returns the id of the first function of the table.
+uint64_t EPP(init)(const FunctionTableEntry *Table, uint32_t Number) {
+    lock_guard<mutex> lock(tlsMutex);
+    uint64_t Base = FunctionTable.size();
+    FunctionTable.insert(FunctionTable.end(), Table, Table + Number);
+    NumberOfModules++;
+    return Base;
+}
 
 void EPP(logPath)(uint64_t Val, uint64_t FunctionId) {
     if (Data)
         Data->log(Val, FunctionId);
 }
 
-void EPP(save)(char *path) {
+/// History[0] holds the number of valid paths in History[1..K], the
+/// oldest first. Once K iterations have been seen, every iteration
+/// completes a new (overlapping) window of K consecutive paths. Only the
+/// iterations which take the back edge are logged here, the path of the
+/// exiting iteration continues past the loop and is not part of a window.
+void EPP(logLoopPath)(uint64_t *History, uint64_t Val, uint64_t FunctionId,
+                      uint32_t LoopId, uint32_t K) {
+    if (History[0] == K) {
+        memmove(&History[1], &History[2], (K - 1) * sizeof(uint64_t));
+        History[K] = Val;
+    } else {
+        History[++History[0]] = Val;
+    }
 
-    FILE *fp = fopen(path, "w");
+    if (History[0] == K && Data)
+        Data->logLoop(&History[1], K, FunctionId, LoopId);
+}
+
+/// With EPP_ACCUMULATE set in the environment, the counts are added to
+/// the existing profile instead of replacing it, so that many runs of the
+/// program, even concurrent ones, build up a single profile. The profile
+/// is saved once, by the destructor of the last instrumented module.
+void EPP(save)(char *path) {
+    if (NumberOfModules > 1) {
+        NumberOfModules--;
+        return;
+    }
 
     // TODO: Modify to enable option of per thread dump
 
-    TLSDataTy Accumulate(EPP(numberOfFunctions));
+    TLSDataTy Accumulate;
+    Accumulate.Paths.resize(FunctionTable.size());
+    // Windows of each loop, keyed by the function GUID and loop id.
+    map<pair<uint64_t, uint32_t>, map<vector<uint64_t>, uint64_t>> Loops;
 
     for (auto T : GlobalEPPDataList) {
-        for (uint32_t I = 0; I < T->size(); I++) {
-            for (auto &KV : T->at(I)) {
-                Accumulate[I][KV.first] += KV.second;
+        for (uint32_t I = 0; I < T->Paths.size(); I++) {
+            for (auto &KV : T->Paths[I]) {
+                Accumulate.Paths[I][KV.first] += KV.second;
+            }
+        }
+        for (uint32_t I = 0; I < T->Loops.size(); I++) {
+            for (uint32_t L = 0; L < T->Loops[I].size(); L++) {
+                auto &W = T->Loops[I][L];
+                if (W.Counts.empty())
+                    continue;
+                auto &Windows = Loops[{FunctionTable[I].GUID, L}];
+                for (auto &KV : W.Counts) {
+                    Windows[vector<uint64_t>(KV.first.begin(),
+                                             KV.first.begin() + W.K)] +=
+                        KV.second;
+                }
             }
         }
     }
 
     // Save the data to a file. Make the dump deterministic by
-    // sorting the function ids, and then sorting the paths by
+    // sorting the function GUIDs, and then sorting the paths by
     // their freq/id. The path printer already sorts by freq.
 
-    for (uint32_t I = 0; I < Accumulate.size(); I++) {
-        if (Accumulate[I].size() > 0) {
-            fprintf(fp, "%u %lu\n", I, Accumulate[I].size());
-            vector<pair<uint64_t, uint64_t>> Values(Accumulate[I].begin(),
-                                                    Accumulate[I].end());
-            sort(Values.begin(), Values.end(),
-                 [](const pair<uint64_t, uint64_t> &P1,
-                    const pair<uint64_t, uint64_t> &P2) {
-                     return (P1.second > P2.second) ||
-                            (P1.second == P2.second && P1.first > P2.first);
-                 });
-            for (auto &KV : Values) {
-                fprintf(fp, "%016" PRIx64 " %" PRIu64 "\n", KV.first,
-                        KV.second);
-            }
+    vector<pair<uint64_t, uint32_t>> Functions;
+    for (uint32_t I = 0; I < Accumulate.Paths.size(); I++) {
+        Functions.push_back({FunctionTable[I].GUID, I});
+    }
+    sort(Functions.begin(), Functions.end());
+
+    // The table of the executed functions comes first. It lets the
+    // decoder reject the profile of a function whose CFG has changed
+    // since it was instrumented.
+    vector<Section> Sections;
+    for (auto &Fn : Functions) {
+        if (Accumulate.Paths[Fn.second].size() > 0) {
+            auto &Entry = FunctionTable[Fn.second];
+            Section S;
+            S.Kind     = Section::FunctionEntry;
+            S.GUID     = Entry.GUID;
+            S.NumPaths = Entry.NumPaths;
+            S.CFGHash  = Entry.CFGHash;
+            S.Name     = Entry.Name;
+            Sections.push_back(std::move(S));
+        }
+    }
+
+    for (auto &Fn : Functions) {
+        auto &Paths = Accumulate.Paths[Fn.second];
+        if (Paths.size() > 0) {
+            Section S;
+            S.Kind = Section::Paths;
+            S.GUID = Fn.first;
+            setPaths(S, Paths);
+            Sections.push_back(std::move(S));
         }
     }
 
+    // Loop windows follow the path records, one section per loop. Each
+    // record lists the K path ids of the window in iteration order.
+    for (auto &L : Loops) {
+        Section S;
+        S.Kind   = Section::LoopWindows;
+        S.GUID   = L.first.first;
+        S.LoopId = L.first.second;
+        S.K      = L.second.begin()->first.size();
+        setWindows(S, L.second);
+        Sections.push_back(std::move(S));
+    }
+
+    const char *Accumulating = getenv("EPP_ACCUMULATE");
+    if (Accumulating && *Accumulating && strcmp(Accumulating, "0") != 0) {
+        saveAccumulated(path, Sections);
+        return;
+    }
+
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "EPP: could not write %s: %s\n", path,
+                strerror(errno));
+        return;
+    }
+    ProfileWriter Writer(fp);
+    for (auto &S : Sections)
+        Writer.write(S);
+    Writer.finish();
     fclose(fp);
 }
 }
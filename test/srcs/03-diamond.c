@@ -15,4 +15,5 @@ int main(int argc, char* argv[]) {
 // RUN: clang -v %t.epp.bc -o %t-exec -lepp-rt 2> %t.compile 
 // RUN: %t-exec > %t.log
 // RUN: llvm-epp -p=%t.profile %t.bc 2> %t.decode
-// RUN: diff -aub %t.profile %s.txt
+// RUN: sed -e '/^function /d' -e '/^index /,$d' %t.profile > %t.paths
+// RUN: diff -aub %t.paths %s.txt
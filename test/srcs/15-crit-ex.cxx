@@ -20,4 +20,10 @@ int main(int argc, char* argv[]) {
 // RUN: clang -v %t.epp.bc -o %t-exec -lepp-rt -lstdc++ 2> %t.compile 
 // RUN: %t-exec > %t.log
 // RUN: llvm-epp -p=%t.profile %t.bc 2> %t.decode
-// RUN: diff -aub %t.profile %s.txt
+// Most functions of this test come from libstdc++, whose mangled names
+// (and hence GUIDs) depend on the standard library version. Compare every
+// path section with its key dropped, one sorted line per section, and
+// check main by its GUID.
+// RUN: awk '/^function /{next} /^index /{exit} n==0{if(s)print s; s=$2; n=$2; next} {s=s" "$1":"$2; n--} END{if(s)print s}' %t.profile | LC_ALL=C sort > %t.sections
+// RUN: diff -aub %t.sections %s.txt
+// RUN: grep -x -A1 "db956436e78dd5fa 1" %t.profile | grep -x "0000000000000000 1"
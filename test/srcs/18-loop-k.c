@@ -0,0 +1,31 @@
+#include <stdio.h>
+
+// With -k=2 every pair of consecutive iterations of the loop is a window.
+// The first pair starts with the iteration entered from the function
+// entry, path 4, the other eight are two iterations through the back
+// edge, path 0. Every iteration runs the printf.
+
+int main(int argc, char* argv[]) { 
+    for(int i = 0; i < 10; i++) {
+        printf("This is a loop");
+    }
+    return 0;
+}
+
+// RUN: clang -c -g -emit-llvm %s -o %t.1.bc 
+// RUN: opt -instnamer %t.1.bc -o %t.bc
+// RUN: llvm-epp -k=2 %t.bc -o %t.profile
+// RUN: clang -v %t.epp.bc -o %t-exec -lepp-rt 2> %t.compile 
+// RUN: %t-exec > %t.log
+// RUN: llvm-epp -p=%t.profile %t.bc 2> %t.decode
+// RUN: sed -e '/^function /d' -e '/^index /,$d' %t.profile > %t.paths
+// RUN: diff -aub %t.paths %s.txt
+// RUN: sed -n '/^# Decoded Loop Paths/,$p' %t.decode > %t.loops
+// RUN: grep "^  k: 2$" %t.loops
+// RUN: grep "^  num_exec_windows: 2$" %t.loops
+// RUN: awk '/^  - window:/{if (w) print w; w=$3} /^    - path:/{w=w " " $3} END{print w}' %t.loops > %t.windows
+// RUN: grep -c . %t.windows | grep "^2$"
+// RUN: grep "^8 0 0$" %t.windows
+// RUN: grep "^1 4 0$" %t.windows
+// RUN: grep -n '^ *printf("This is a loop");$' %s | cut -d: -f1 > %t.line
+// RUN: grep -c "18-loop-k.c,`cat %t.line`$" %t.loops | grep "^4$"
@@ -0,0 +1,13 @@
+
+int main(int argc, char* argv[]) { 
+    if(argc > 2) {
+        printf("This is a triangle");
+    }
+    return 0; 
+}
+
+// RUN: clang -O2 -g -Xclang -load -Xclang EPPPlugin.so -mllvm -epp-save-module=%t.bc -mllvm -epp-output=%t.profile %s -o %t-exec -lepp-rt 2> %t.compile
+// RUN: %t-exec > %t.log
+// RUN: llvm-epp -p=%t.profile %t.bc 2> %t.decode
+// RUN: sed -e '/^function /d' -e '/^index /,$d' %t.profile > %t.paths
+// RUN: diff -aub %t.paths %s.txt
@@ -0,0 +1,27 @@
+// A chain of 65536 conditional returns, about 130k basic blocks in main.
+// The DFS over the CFG used to recurse once per block and overflow the
+// stack. The timeouts only keep a much slower traversal from hanging the
+// test suite, they do not measure how the time scales with the CFG.
+
+#define R1(x) if (argc == (x)) return 0;
+#define R4(x) R1(4*(x)) R1(4*(x) + 1) R1(4*(x) + 2) R1(4*(x) + 3)
+#define R16(x) R4(4*(x)) R4(4*(x) + 1) R4(4*(x) + 2) R4(4*(x) + 3)
+#define R64(x) R16(4*(x)) R16(4*(x) + 1) R16(4*(x) + 2) R16(4*(x) + 3)
+#define R256(x) R64(4*(x)) R64(4*(x) + 1) R64(4*(x) + 2) R64(4*(x) + 3)
+#define R1K(x) R256(4*(x)) R256(4*(x) + 1) R256(4*(x) + 2) R256(4*(x) + 3)
+#define R4K(x) R1K(4*(x)) R1K(4*(x) + 1) R1K(4*(x) + 2) R1K(4*(x) + 3)
+#define R16K(x) R4K(4*(x)) R4K(4*(x) + 1) R4K(4*(x) + 2) R4K(4*(x) + 3)
+#define R64K(x) R16K(4*(x)) R16K(4*(x) + 1) R16K(4*(x) + 2) R16K(4*(x) + 3)
+
+int main(int argc, char* argv[]) {
+    R64K(0)
+    return 0;
+}
+
+// RUN: clang -c -emit-llvm %s -o %t.bc
+// RUN: timeout 60s llvm-epp %t.bc -o %t.profile 2> %t.log
+// RUN: grep "num_paths: 65537" %t.log
+// RUN: clang -v %t.epp.bc -o %t-exec -lepp-rt 2> %t.compile
+// RUN: %t-exec > %t.out
+// RUN: timeout 60s llvm-epp -p=%t.profile %t.bc 2> %t.decode
+// RUN: grep "num_exec_paths: 1" %t.decode
@@ -0,0 +1,45 @@
+#include <stdio.h>
+
+int triangle(int i) {
+    if (i % 3)
+        printf("triangle");
+    return i;
+}
+
+int main(int argc, char* argv[]) {
+    for(int i = 0; i < 10; i++) {
+        if(i%2) {
+            printf("This is a loop");
+        }
+        triangle(i);
+    }
+    return 0;
+}
+
+// Decoding with the encoding file written next to the profile must give
+// the same output as decoding with the module. The binary output is read
+// back and must hold the same records as the YAML output.
+
+// RUN: rm -f %t.profile.enc
+// RUN: clang -c -g -emit-llvm %s -o %t.1.bc
+// RUN: opt -instnamer %t.1.bc -o %t.bc
+// RUN: llvm-epp -k=2 %t.bc -o %t.profile
+// RUN: clang -v %t.epp.bc -o %t-exec -lepp-rt 2> %t.compile
+// RUN: %t-exec > %t.log
+// RUN: llvm-epp -p=%t.profile %t.bc 2> %t.decode
+// RUN: llvm-epp -p=%t.profile 2> %t.decode.enc
+// RUN: diff -aub %t.decode %t.decode.enc
+// RUN: mv %t.profile.enc %t.enc
+// RUN: llvm-epp -p=%t.profile -e=%t.enc 2> %t.decode.e
+// RUN: diff -aub %t.decode %t.decode.e
+// RUN: llvm-epp -j=4 -p=%t.profile %t.bc 2> %t.decode.j
+// RUN: diff -aub %t.decode %t.decode.j
+// RUN: llvm-epp -j=4 -p=%t.profile -e=%t.enc 2> %t.decode.ej
+// RUN: diff -aub %t.decode %t.decode.ej
+// RUN: llvm-epp -p=%t.profile -e=%t.enc -output-format=json -decode-output=%t.json
+// RUN: %python -c "import json, sys; r = json.load(open(sys.argv[1])); assert {x['kind'] for x in r} == {'function', 'loop'}" %t.json
+// RUN: grep '"name": "triangle"' %t.json
+// RUN: llvm-epp -p=%t.profile -e=%t.enc -output-format=binary -decode-output=%t.bin
+// RUN: head -c 4 %t.bin | grep EPPD
+// RUN: %python %S/Inputs/binary-to-yaml.py %t.bin > %t.bin.yaml
+// RUN: grep -v "^#" %t.decode.e | diff - %t.bin.yaml
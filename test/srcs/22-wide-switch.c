@@ -0,0 +1,47 @@
+// A switch with 1024 cases inside a loop. Each iteration takes a different
+// case, so many paths share the prefix up to the switch block and decoding
+// picks among 1025 successors at each of them. Only the first iteration
+// starts at the entry block, only the default case decrements s and only
+// the exit path returns, so each of these lines is on exactly one of the
+// decoded paths, and the switch is on all of them but the exit path.
+//
+// The 2049 executions are 1023 paths taken twice, for the cases 2 to 1023
+// and the default, and three paths taken once. Covering half of them
+// takes 513 of the paths taken twice.
+
+#define C1(x) case (x): s += (x); break;
+#define C4(x) C1(4*(x)) C1(4*(x) + 1) C1(4*(x) + 2) C1(4*(x) + 3)
+#define C16(x) C4(4*(x)) C4(4*(x) + 1) C4(4*(x) + 2) C4(4*(x) + 3)
+#define C64(x) C16(4*(x)) C16(4*(x) + 1) C16(4*(x) + 2) C16(4*(x) + 3)
+#define C256(x) C64(4*(x)) C64(4*(x) + 1) C64(4*(x) + 2) C64(4*(x) + 3)
+#define C1K(x) C256(4*(x)) C256(4*(x) + 1) C256(4*(x) + 2) C256(4*(x) + 3)
+
+int main(int argc, char* argv[]) {
+    volatile int s = 0;
+    for (int i = 0; i < 2048; i++) {
+        switch (i % 1024 + argc) {
+            C1K(0)
+        default:
+            s--;
+        }
+    }
+    return 0;
+}
+
+// RUN: clang -c -g -emit-llvm %s -o %t.bc
+// RUN: llvm-epp %t.bc -o %t.profile 2> %t.log
+// RUN: clang -v %t.epp.bc -o %t-exec -lepp-rt 2> %t.compile
+// RUN: %t-exec > %t.out
+// RUN: timeout 60s llvm-epp -p=%t.profile %t.bc 2> %t.decode
+// RUN: grep "num_exec_paths: 1026" %t.decode
+// RUN: echo 'BEGIN{n=0} /^  - path:/{n+=m; m=0} $NF ~ ("wide-switch.c," L "$"){m=1} END{print n+m}' > %t.count
+// RUN: awk -v L=`grep -n "^ *volatile int s = 0;$" %s | cut -d: -f1` -f %t.count %t.decode | grep "^1$"
+// RUN: awk -v L=`grep -n "^ *s--;$" %s | cut -d: -f1` -f %t.count %t.decode | grep "^1$"
+// RUN: awk -v L=`grep -n "^ *return 0;$" %s | cut -d: -f1` -f %t.count %t.decode | grep "^1$"
+// RUN: awk -v L=`grep -n "^ *switch (i" %s | cut -d: -f1` -f %t.count %t.decode | grep "^1025$"
+// RUN: llvm-epp -top=10 -p=%t.profile %t.bc 2> %t.top
+// RUN: grep "num_printed_paths: 10" %t.top
+// RUN: test `grep -c "  - path:" %t.top` -eq 10
+// RUN: llvm-epp -coverage=0.5 -p=%t.profile %t.bc 2> %t.coverage
+// RUN: grep "num_printed_paths: 513" %t.coverage
+// RUN: test `grep -c "  - path:" %t.coverage` -eq 513
@@ -0,0 +1,25 @@
+// Truncated and corrupted profiles are reported with the line of the
+// error instead of being decoded. The path section of main is found by
+// the GUID the function table gives it, and the lines of the errors are
+// counted in the broken profiles.
+
+int main(int argc, char* argv[]) {
+    if (argc > 1)
+        return 1;
+    return 0;
+}
+
+// RUN: clang -c -emit-llvm %s -o %t.bc
+// RUN: llvm-epp %t.bc -o %t.profile
+// RUN: clang -v %t.epp.bc -o %t-exec -lepp-rt 2> %t.compile
+// RUN: %t-exec > %t.log
+// RUN: awk '$1 == "function" && $NF == "main" {print $2}' %t.profile > %t.guid
+// RUN: sed '/^index /,$d' %t.profile > %t.truncated
+// RUN: echo "`cat %t.guid` 2" >> %t.truncated
+// RUN: expr `wc -l < %t.truncated` + 1 > %t.line1
+// RUN: ! llvm-epp -p=%t.truncated %t.bc 2> %t.err1
+// RUN: grep "Invalid profile .*:`cat %t.line1`: missing path records" %t.err1
+// RUN: sed "s/^`cat %t.guid` 1$/`cat %t.guid` x/" %t.profile > %t.corrupt
+// RUN: grep -n "^`cat %t.guid` x$" %t.corrupt | cut -d: -f1 > %t.line2
+// RUN: ! llvm-epp -p=%t.corrupt %t.bc 2> %t.err2
+// RUN: grep "Invalid profile .*:`cat %t.line2`: expected a decimal number" %t.err2
@@ -0,0 +1,33 @@
+// The paths of the loop fold into the counts of its branches: the loop
+// condition is true 10 times and false once, and each side of the if is
+// taken 5 times. The branch after the loop has a critical edge, which is
+// split to profile, but the annotated module keeps the blocks of the input.
+
+int main(int argc, char* argv[]) {
+    int s = 0;
+    for (int i = 0; i < 10; i++) {
+        if (i % 2)
+            s += i;
+        else
+            s -= i;
+    }
+    if (s > 100)
+        s = 100;
+    return s;
+}
+
+// RUN: clang -c -g -emit-llvm %s -o %t.bc
+// RUN: llvm-epp %t.bc -o %t.profile
+// RUN: clang -v %t.epp.bc -o %t-exec -lepp-rt 2> %t.compile
+// RUN: %t-exec > %t.log
+// RUN: llvm-epp -p=%t.profile -annotate=%t.prof.bc -sample-profile=%t.prof %t.bc
+// RUN: llvm-dis %t.prof.bc -o %t.prof.ll
+// RUN: grep '!"function_entry_count", i64 1}' %t.prof.ll
+// RUN: grep '!"branch_weights", i32 10, i32 1}' %t.prof.ll
+// RUN: grep '!"branch_weights", i32 5, i32 5}' %t.prof.ll
+// RUN: grep '!"branch_weights", i32 0, i32 1}' %t.prof.ll
+// RUN: llvm-dis %t.bc -o %t.ll
+// RUN: ! grep "crit_edge" %t.prof.ll
+// RUN: test `grep -c "^[a-z.0-9]*:" %t.ll` -eq `grep -c "^[a-z.0-9]*:" %t.prof.ll`
+// RUN: grep "^main:[0-9]*:1$" %t.prof
+// RUN: llvm-profdata merge -sample -text %t.prof -o %t.merged
@@ -0,0 +1,46 @@
+// The hot path of the loop goes through the merge point after the if, so
+// the merge point and the rest of the loop body are duplicated. In nested,
+// the hot path goes through a merge point into the inner loop, which is
+// not duplicated: the copies stop before its header. The optimized module
+// must compute the same result.
+
+#include <stdio.h>
+
+int nested(int n) {
+    int s = 0;
+    for (int i = 0; i < n; i++) {
+        if (i % 10)
+            s += i;
+        else
+            s -= i;
+        for (int j = 0; j < 3; j++)
+            s ^= j;
+    }
+    return s;
+}
+
+int main(int argc, char* argv[]) {
+    int s = nested(argc + 99);
+    for (int i = 0; i < 100; i++) {
+        if (i % 10)
+            s += i;
+        else
+            s -= i;
+        s ^= argc;
+    }
+    printf("%d\n", s);
+    return 0;
+}
+
+// RUN: clang -c -g -emit-llvm %s -o %t.bc
+// RUN: llvm-epp %t.bc -o %t.profile
+// RUN: clang -v %t.epp.bc -o %t-exec -lepp-rt 2> %t.compile
+// RUN: %t-exec > %t.log
+// RUN: llvm-epp -p=%t.profile -superblocks=%t.sb.bc %t.bc 2> %t.sb.log
+// RUN: grep "# Formed [1-9][0-9]* superblocks" %t.sb.log
+// RUN: llvm-dis %t.sb.bc -o %t.sb.ll
+// RUN: grep "\.sb:" %t.sb.ll
+// RUN: ! grep "^for\.cond[0-9]*\.sb:" %t.sb.ll
+// RUN: clang %t.sb.bc -o %t-sb-exec
+// RUN: %t-sb-exec > %t.sb.out
+// RUN: diff %t.log %t.sb.out
@@ -0,0 +1,32 @@
+// The hot path of the loop body is outlined into main.epp.path1, which is
+// called from the loop. The outlined module must compute the same result.
+// A path shorter than -outline-min-size is left in place.
+
+#include <stdio.h>
+
+int main(int argc, char* argv[]) {
+    int s = 0;
+    for (int i = 0; i < 100; i++) {
+        if (i % 10)
+            s += i;
+        else
+            s -= i;
+        s ^= argc;
+    }
+    printf("%d\n", s);
+    return 0;
+}
+
+// RUN: clang -c -g -emit-llvm %s -o %t.bc
+// RUN: llvm-epp %t.bc -o %t.profile
+// RUN: clang -v %t.epp.bc -o %t-exec -lepp-rt 2> %t.compile
+// RUN: %t-exec > %t.log
+// RUN: llvm-epp -p=%t.profile -outline=%t.outlined.bc %t.bc 2> %t.outline.log
+// RUN: grep "# Outlined 1 paths" %t.outline.log
+// RUN: llvm-dis %t.outlined.bc -o %t.outlined.ll
+// RUN: grep "call .*@main.epp.path1(" %t.outlined.ll
+// RUN: clang %t.outlined.bc -o %t-outlined-exec
+// RUN: %t-outlined-exec > %t.outlined.out
+// RUN: diff %t.log %t.outlined.out
+// RUN: llvm-epp -p=%t.profile -outline=%t.small.bc -outline-min-size=1000 %t.bc 2> %t.small.log
+// RUN: grep "# Outlined 0 paths" %t.small.log
@@ -0,0 +1,25 @@
+// Merging a profile with itself doubles every frequency, as does giving it
+// a weight of 2: the if is taken 6 times per run. Merging on several
+// threads gives the same profile.
+
+int main(int argc, char* argv[]) {
+    int s = 0;
+    for (int i = 0; i < 10; i++) {
+        if (i % 3)
+            s += i;
+    }
+    return s > 100;
+}
+
+// RUN: clang -c -g -emit-llvm %s -o %t.bc
+// RUN: llvm-epp %t.bc -o %t.profile
+// RUN: clang -v %t.epp.bc -o %t-exec -lepp-rt 2> %t.compile
+// RUN: %t-exec > %t.log
+// RUN: llvm-epp merge %t.profile %t.profile -o %t.twice
+// RUN: llvm-epp merge -weighted-input=2,%t.profile -o %t.weighted
+// RUN: diff %t.twice %t.weighted
+// RUN: llvm-epp merge %t.profile %t.profile %t.profile %t.profile -o %t.four
+// RUN: llvm-epp merge -j=2 %t.twice %t.profile %t.profile -o %t.four-j
+// RUN: diff %t.four %t.four-j
+// RUN: llvm-epp -p=%t.twice -output-format=json %t.bc > %t.decoded
+// RUN: grep '"freq": 12,' %t.decoded
@@ -0,0 +1,21 @@
+// With EPP_ACCUMULATE set, every run adds its counts to the profile, which
+// after three runs is the same as three profiles of one run merged.
+
+int main(int argc, char* argv[]) {
+    int s = 0;
+    for (int i = 0; i < 10; i++) {
+        if (i % 3)
+            s += i;
+    }
+    return s > 100;
+}
+
+// RUN: clang -c -g -emit-llvm %s -o %t.bc
+// RUN: llvm-epp %t.bc -o %t.profile
+// RUN: clang -v %t.epp.bc -o %t-exec -lepp-rt 2> %t.compile
+// RUN: %t-exec > %t.log
+// RUN: cp %t.profile %t.single
+// RUN: env EPP_ACCUMULATE=1 %t-exec >> %t.log
+// RUN: env EPP_ACCUMULATE=1 %t-exec >> %t.log
+// RUN: llvm-epp merge %t.single %t.single %t.single -o %t.three
+// RUN: diff %t.profile %t.three
@@ -0,0 +1,32 @@
+// A run with an argument takes the other side of the if in the loop. Both
+// the first iteration, which starts at the entry block, and the iterations
+// which start at the loop header go through the if, so the diff reports
+// two paths as vanished and two as new. The exit path is unchanged.
+
+int main(int argc, char* argv[]) {
+    int s = 0;
+    for (int i = 0; i < 10; i++) {
+        if (argc > 1)
+            s += i;
+        else
+            s -= i;
+    }
+    return s > 100;
+}
+
+// RUN: clang -c -g -emit-llvm %s -o %t.bc
+// RUN: llvm-epp %t.bc -o %t.profile
+// RUN: clang -v %t.epp.bc -o %t-exec -lepp-rt 2> %t.compile
+// RUN: %t-exec > %t.log
+// RUN: cp %t.profile %t.old
+// RUN: %t-exec arg >> %t.log
+// RUN: llvm-epp diff %t.old %t.profile > %t.diff
+// RUN: grep "changed_paths: 4" %t.diff
+// RUN: grep "new_paths: 2" %t.diff
+// RUN: grep "vanished_paths: 2" %t.diff
+// RUN: grep "change: vanished" %t.diff
+// RUN: grep "change: new" %t.diff
+// RUN: grep "29-diff.c,8" %t.diff
+// RUN: llvm-epp diff -rank=relative -top=1 %t.old %t.profile > %t.top
+// RUN: grep -c "  path: " %t.top | grep "^1$"
+// RUN: grep "change: new" %t.top
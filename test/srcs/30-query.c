@@ -0,0 +1,29 @@
+// Only the paths of the queried function are decoded, the same as in the
+// full decode of the profile.
+
+int square(int x) { return x * x; }
+
+int sum(int n) {
+    int s = 0;
+    for (int i = 0; i < n; i++)
+        s += i % 3 ? square(i) : i;
+    return s;
+}
+
+int main() { return sum(10) > 1000; }
+
+// RUN: rm -f %t.profile.enc
+// RUN: clang -c -g -emit-llvm %s -o %t.bc
+// RUN: llvm-epp %t.bc -o %t.profile
+// RUN: clang -v %t.epp.bc -o %t-exec -lepp-rt 2> %t.compile
+// RUN: %t-exec > %t.log
+// RUN: grep "^index-offset [0-9]\{20\}$" %t.profile
+// RUN: llvm-epp query -function=sum %t.profile 2> %t.query
+// RUN: grep -c "^- name: " %t.query | grep "^1$"
+// RUN: grep "^- name: sum$" %t.query
+// RUN: llvm-epp -p=%t.profile 2> %t.full
+// RUN: grep -A 3 "^- name: sum$" %t.full > %t.expected
+// RUN: grep -A 3 "^- name: sum$" %t.query | diff - %t.expected
+// RUN: llvm-epp merge %t.profile -o %t.merged
+// RUN: llvm-epp query -function=square -e %t.profile.enc %t.merged 2> %t.square
+// RUN: grep "^- name: square$" %t.square
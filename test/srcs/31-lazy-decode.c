@@ -0,0 +1,27 @@
+// Decoding with the module only reads the bodies of the profiled functions,
+// and prints the same paths as decoding with the encoding file.
+
+int never(int x) {
+    for (int i = 0; i < x; i++)
+        x ^= i;
+    return x;
+}
+
+int once(int x) { return x > 3 ? x - 3 : x + 3; }
+
+int main(int argc, char* argv[]) {
+    if (argc > 5)
+        return never(argc);
+    return once(argc) > 10;
+}
+
+// RUN: rm -f %t.profile.enc
+// RUN: clang -c -g -emit-llvm %s -o %t.bc
+// RUN: llvm-epp %t.bc -o %t.profile
+// RUN: clang -v %t.epp.bc -o %t-exec -lepp-rt 2> %t.compile
+// RUN: %t-exec > %t.log
+// RUN: llvm-epp -p=%t.profile %t.bc 2> %t.module
+// RUN: llvm-epp -p=%t.profile 2> %t.encoding
+// RUN: diff %t.module %t.encoding
+// RUN: grep "^- name: once$" %t.module
+// RUN: grep -c "^- name: " %t.module | grep "^2$"
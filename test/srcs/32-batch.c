@@ -0,0 +1,38 @@
+// Two modules instrumented in one invocation are linked into one program,
+// and the profile holds the paths of the functions of both. Instrumented
+// in separate invocations with the same profile, both modules append to
+// the encoding file, so the profile still decodes without them.
+
+#ifdef SECOND
+int twice(int x) { return x > 0 ? 2 * x : 0; }
+#else
+int twice(int x);
+
+int main(int argc, char* argv[]) {
+    int s = 0;
+    for (int i = 0; i < argc + 3; i++)
+        s += twice(i);
+    return s > 100;
+}
+#endif
+
+// RUN: rm -f %t.profile.enc %t.sep.profile.enc
+// RUN: clang -c -g -emit-llvm %s -o %t.a.bc
+// RUN: clang -c -g -emit-llvm -DSECOND %s -o %t.b.bc
+// RUN: echo %t.b.bc > %t.rsp
+// RUN: llvm-epp -j=2 %t.a.bc @%t.rsp -o %t.profile 2> %t.report
+// RUN: grep "^- name: main$" %t.report
+// RUN: grep "^- name: twice$" %t.report
+// RUN: clang -v %t.a.epp.bc %t.b.epp.bc -o %t-exec -lepp-rt 2> %t.compile
+// RUN: %t-exec > %t.log
+// RUN: grep -c "^function " %t.profile | grep "^2$"
+// RUN: llvm-epp -p=%t.profile 2> %t.decoded
+// RUN: grep "^- name: main$" %t.decoded
+// RUN: grep "^- name: twice$" %t.decoded
+// RUN: llvm-epp %t.a.bc -o %t.sep.profile
+// RUN: llvm-epp %t.b.bc -o %t.sep.profile
+// RUN: grep -c "^function " %t.sep.profile.enc | grep "^2$"
+// RUN: clang -v %t.a.epp.bc %t.b.epp.bc -o %t-sep -lepp-rt 2> %t.compile
+// RUN: %t-sep > %t.log
+// RUN: llvm-epp -p=%t.sep.profile 2> %t.sep.decoded
+// RUN: diff %t.decoded %t.sep.decoded
@@ -0,0 +1,30 @@
+// A profile is only decoded against the CFG it was recorded with. The
+// program is built again with CHANGED defined, which adds a branch to
+// step: its paths are skipped, main is unchanged and still decoded.
+
+int step(int i) {
+#ifdef CHANGED
+    if (i > 5)
+        return i * 2;
+#endif
+    return i + 1;
+}
+
+int main(int argc, char* argv[]) {
+    int s = 0;
+    for (int i = 0; i < 10; i++)
+        s += step(i);
+    return s > 100;
+}
+
+// RUN: clang -c -g -emit-llvm %s -o %t.bc
+// RUN: llvm-epp %t.bc -o %t.profile
+// RUN: clang -v %t.epp.bc -o %t-exec -lepp-rt 2> %t.compile
+// RUN: %t-exec > %t.log
+// RUN: llvm-epp -p=%t.profile %t.bc 2> %t.decode
+// RUN: grep "^- name: step$" %t.decode
+// RUN: clang -DCHANGED -c -g -emit-llvm %s -o %t.changed.bc
+// RUN: llvm-epp -p=%t.profile %t.changed.bc 2> %t.stale
+// RUN: grep "# Skipping stale profile of function step" %t.stale
+// RUN: grep "^- name: main$" %t.stale
+// RUN: ! grep "^- name: step$" %t.stale
@@ -0,0 +1,84 @@
+# Print the binary output of the decoder as the YAML output would show it,
+# without the comment lines, so the two can be compared.
+
+import struct
+import sys
+
+
+class Reader:
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def read(self, fmt):
+        value = struct.unpack_from('<' + fmt, self.data, self.pos)[0]
+        self.pos += struct.calcsize(fmt)
+        return value
+
+    def str(self):
+        size = self.read('I')
+        self.pos += size
+        return self.data[self.pos - size:self.pos].decode()
+
+
+def tables(r):
+    blocks = [r.str() for _ in range(r.read('I'))]
+    files = [r.str() for _ in range(r.read('I'))]
+    return blocks, files
+
+
+def path(r, files, prefix):
+    out = ['%s- path: %X' % (prefix[:-4], r.read('Q'))]
+    r.read('B')
+    for _ in range(r.read('I')):
+        r.read('I')
+    for _ in range(r.read('I')):
+        f = r.read('I')
+        out.append('%s- %s,%d' % (prefix, files[f], r.read('I')))
+    return out
+
+
+def main():
+    r = Reader(open(sys.argv[1], 'rb').read())
+    assert r.data[:4] == b'EPPD', 'bad magic'
+    r.pos = 4
+    assert r.read('I') == 1, 'unknown version'
+    out = []
+    while True:
+        kind = r.read('B')
+        if kind == 0:
+            break
+        r.read('Q')
+        out.append('- name: ' + r.str())
+        if kind == 1:
+            executed = r.read('Q')
+            blocks, files = tables(r)
+            printed = r.read('Q')
+            out.append('  num_exec_paths: %d' % executed)
+            if printed < executed:
+                out.append('  num_printed_paths: %d' % printed)
+            for _ in range(printed):
+                r.read('Q')
+                out += path(r, files, '      ')
+        elif kind == 2:
+            out.append('  loop: %d' % r.read('I'))
+            out.append('  header: ' + r.str())
+            k = r.read('I')
+            out.append('  k: %d' % k)
+            executed = r.read('Q')
+            blocks, files = tables(r)
+            printed = r.read('Q')
+            out.append('  num_exec_windows: %d' % executed)
+            if printed < executed:
+                out.append('  num_printed_windows: %d' % printed)
+            for _ in range(printed):
+                out.append('  - window: %d' % r.read('Q'))
+                for _ in range(k):
+                    out += path(r, files, '        ')
+        else:
+            sys.exit('unknown section kind %d' % kind)
+    assert r.pos == len(r.data), 'trailing bytes'
+    print('\n'.join(out))
+
+
+main()
@@ -33,10 +33,12 @@
 #include "llvm/Support/SourceMgr.h"
 #include "llvm/Support/TargetRegistry.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Support/ToolOutputFile.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/Passes.h"
@@ -46,8 +48,15 @@
 #include <string>
 
 #include "BreakSelfLoopsPass.h"
+#include "EPPEdgeProfile.h"
+#include "EPPEncode.h"
+#include "EPPOutline.h"
 #include "EPPPathPrinter.h"
 #include "EPPProfile.h"
+#include "EPPSuperblock.h"
+#include "ProfileDiff.h"
+#include "ProfileMerger.h"
+#include "ProfileReader.h"
 #include "SplitLandingPadPredsPass.h"
 
 using namespace std;
@@ -58,9 +67,11 @@ using namespace epp;
 cl::OptionCategory LLVMEppOptionCategory("EPP Options",
                                          "Additional options for the EPP tool");
 
-cl::opt<string> inPath(cl::Positional, cl::desc("Module to analyze"),
-                       cl::value_desc("filename"), cl::Required,
-                       cl::cat(LLVMEppOptionCategory));
+cl::list<string> inPaths(cl::Positional,
+                         cl::desc("Modules to instrument, or the module to "
+                                  "analyze"),
+                         cl::value_desc("filenames"), cl::ZeroOrMore,
+                         cl::cat(LLVMEppOptionCategory));
 
 cl::opt<string>
     profileOutputFilename("o", cl::desc("Filename of the output path profile"),
@@ -72,6 +83,20 @@ cl::opt<string> profile("p", cl::desc("Path to path profiling results"),
                         cl::value_desc("filename"),
                         cl::cat(LLVMEppOptionCategory));
 
+cl::SubCommand MergeCommand("merge", "Merge path profiles into one");
+cl::SubCommand DiffCommand("diff",
+                           "Compare the path frequencies of two profiles");
+cl::SubCommand QueryCommand("query",
+                            "Decode the paths of one function of a profile");
+
+cl::opt<string> encodingFilename(
+    "e", cl::desc("Encoding file to decode the profile with when no module "
+                  "is given, defaults to the profile filename with .enc "
+                  "appended"),
+    cl::value_desc("filename"), cl::sub(*cl::TopLevelSubCommand),
+    cl::sub(DiffCommand), cl::sub(QueryCommand),
+    cl::cat(LLVMEppOptionCategory));
+
 cl::opt<bool> stripDebug(
     "s", cl::desc("Remove debug information from the instrumented bitcode"),
     cl::value_desc("toggle"), cl::Hidden, cl::init(true),
@@ -82,6 +107,129 @@ cl::opt<bool> dumpGraphs("d",
                          cl::value_desc("toggle"), cl::Hidden, cl::init(false),
                          cl::cat(LLVMEppOptionCategory));
 
+cl::opt<unsigned> loopIterations(
+    "k", cl::desc("Also profile windows of k consecutive iteration paths of "
+                  "innermost loops (k > 1)"),
+    cl::value_desc("iterations"), cl::init(0),
+    cl::cat(LLVMEppOptionCategory));
+
+cl::opt<unsigned> numJobs(
+    "j", cl::desc("Number of threads used to encode functions, to "
+                  "instrument several modules, to decode them with -p, or "
+                  "to merge profiles"),
+    cl::value_desc("threads"), cl::init(1), cl::sub(*cl::TopLevelSubCommand),
+    cl::sub(MergeCommand), cl::sub(QueryCommand),
+    cl::cat(LLVMEppOptionCategory));
+
+cl::opt<unsigned> topPaths(
+    "top", cl::desc("Only decode the K most frequent paths of each function "
+                    "with -p"),
+    cl::value_desc("K"), cl::init(0), cl::sub(*cl::TopLevelSubCommand),
+    cl::sub(QueryCommand), cl::cat(LLVMEppOptionCategory));
+
+cl::opt<double> coverage(
+    "coverage", cl::desc("Only decode the most frequent paths of each "
+                         "function which cover this fraction of its "
+                         "executions with -p"),
+    cl::value_desc("fraction"), cl::init(1.0),
+    cl::sub(*cl::TopLevelSubCommand), cl::sub(QueryCommand),
+    cl::cat(LLVMEppOptionCategory));
+
+cl::opt<OutputFormat> outputFormat(
+    "output-format", cl::desc("Format of the paths decoded with -p"),
+    cl::values(clEnumValN(YAMLFormat, "yaml", "Human readable (default)"),
+               clEnumValN(JSONFormat, "json", "JSON records"),
+               clEnumValN(BinaryFormat, "binary", "Binary records")),
+    cl::init(YAMLFormat), cl::sub(*cl::TopLevelSubCommand),
+    cl::sub(QueryCommand), cl::cat(LLVMEppOptionCategory));
+
+cl::opt<string> decodeOutput(
+    "decode-output", cl::desc("File to write the decoded paths to, by "
+                              "default stderr for YAML and stdout otherwise"),
+    cl::value_desc("filename"), cl::sub(*cl::TopLevelSubCommand),
+    cl::sub(QueryCommand), cl::cat(LLVMEppOptionCategory));
+
+cl::opt<string> annotatedFilename(
+    "annotate", cl::desc("Fold the paths of the profile given with -p into "
+                         "branch weights, and save the annotated module"),
+    cl::value_desc("filename"), cl::cat(LLVMEppOptionCategory));
+
+cl::opt<string> sampleProfileFilename(
+    "sample-profile", cl::desc("Fold the paths of the profile given with -p "
+                               "into line counts, and write them as a text "
+                               "sample profile"),
+    cl::value_desc("filename"), cl::cat(LLVMEppOptionCategory));
+
+cl::opt<string> superblocksFilename(
+    "superblocks", cl::desc("Form superblocks along the hottest paths of the "
+                            "profile given with -p, and save the optimized "
+                            "module"),
+    cl::value_desc("filename"), cl::cat(LLVMEppOptionCategory));
+
+cl::opt<unsigned> superblockPaths(
+    "superblock-paths", cl::desc("Number of paths of each function to form "
+                                 "superblocks along"),
+    cl::value_desc("N"), cl::init(4), cl::cat(LLVMEppOptionCategory));
+
+cl::opt<unsigned> superblockGrowth(
+    "superblock-growth", cl::desc("Instructions duplicated to form "
+                                  "superblocks, in percent of the size of "
+                                  "each function"),
+    cl::value_desc("percent"), cl::init(20), cl::cat(LLVMEppOptionCategory));
+
+cl::opt<string> outlineFilename(
+    "outline", cl::desc("Outline the hottest paths of the profile given with "
+                        "-p into functions, and save the module"),
+    cl::value_desc("filename"), cl::cat(LLVMEppOptionCategory));
+
+cl::opt<unsigned> outlinePaths(
+    "outline-paths", cl::desc("Number of paths of each function to outline"),
+    cl::value_desc("N"), cl::init(1), cl::cat(LLVMEppOptionCategory));
+
+cl::opt<unsigned> outlineMinSize(
+    "outline-min-size", cl::desc("Smallest number of instructions on a path "
+                                 "worth the call of outlining it"),
+    cl::value_desc("N"), cl::init(8), cl::cat(LLVMEppOptionCategory));
+
+cl::list<string> mergeInputs(cl::Positional, cl::desc("<profiles>"),
+                             cl::sub(MergeCommand));
+
+cl::list<string> weightedInputs(
+    "weighted-input", cl::desc("A profile to merge, the frequencies of "
+                               "which are multiplied by the weight"),
+    cl::value_desc("weight,filename"), cl::sub(MergeCommand));
+
+cl::opt<string> mergeOutput("o", cl::desc("Filename of the merged profile"),
+                            cl::value_desc("filename"), cl::Required,
+                            cl::sub(MergeCommand));
+
+cl::opt<string> diffOld(cl::Positional, cl::desc("<old profile>"),
+                        cl::Required, cl::sub(DiffCommand));
+
+cl::opt<string> diffNew(cl::Positional, cl::desc("<new profile>"),
+                        cl::Required, cl::sub(DiffCommand));
+
+cl::opt<DiffRanking> diffRanking(
+    "rank", cl::desc("How to rank the paths whose frequency changed"),
+    cl::values(clEnumValN(AbsoluteChange, "absolute",
+                          "By the change of their frequency"),
+               clEnumValN(RelativeChange, "relative",
+                          "By the change relative to their old frequency, "
+                          "new paths first")),
+    cl::init(AbsoluteChange), cl::sub(DiffCommand));
+
+cl::opt<unsigned> diffTop("top", cl::desc("Only list the K largest changes"),
+                          cl::value_desc("K"), cl::init(0),
+                          cl::sub(DiffCommand));
+
+cl::opt<string> queryProfileFilename(cl::Positional, cl::desc("<profile>"),
+                                     cl::Required, cl::sub(QueryCommand));
+
+cl::opt<string> queryFunction("function",
+                              cl::desc("Name of the function to decode"),
+                              cl::value_desc("name"), cl::Required,
+                              cl::sub(QueryCommand));
+
 // cl::opt<bool> wideCounter(
 //     "w",
 //     cl::desc("Use wide (128 bit) counters. Only available on 64 bit
@@ -102,7 +250,8 @@ void saveModule(Module &m, StringRef filename) {
     WriteBitcodeToFile(&m, out);
 }
 
-void instrumentModule(Module &module) {
+void instrumentModule(Module &module, string filename,
+                      EPPProfile::BatchOutput *batch = nullptr) {
 
     // Build up all of the passes that we want to run on the module.
     legacy::PassManager pm;
@@ -111,7 +260,7 @@ void instrumentModule(Module &module) {
     pm.add(createBreakCriticalEdgesPass());
     pm.add(new epp::SplitLandingPadPredsPass());
     pm.add(new LoopInfoWrapperPass());
-    pm.add(new epp::EPPProfile());
+    pm.add(new epp::EPPProfile(batch));
     pm.add(createVerifierPass());
     pm.run(module);
 
@@ -130,11 +279,63 @@ void instrumentModule(Module &module) {
         StripDebugInfo(module);
     }
 
-    replaceExt(inPath, "epp.bc");
-    saveModule(module, inPath);
+    replaceExt(filename, "epp.bc");
+    saveModule(module, filename);
+}
+
+/// Instrument the modules on -j threads, each with a context of its own.
+/// The reports are printed and the encodings written to the encoding file
+/// in the order of the inputs, so the output does not depend on the number
+/// of threads. Functions are logged relative to the first function of
+/// their module, so the instrumented modules can be linked together.
+int instrumentModules(ArrayRef<string> filenames) {
+    vector<EPPProfile::BatchOutput> outputs(filenames.size());
+    vector<string> errors(filenames.size());
+    {
+        // The dot graphs are written to fixed filenames.
+        ThreadPool pool(dumpGraphs ? 1 : numJobs);
+        for (size_t i = 0; i < filenames.size(); i++) {
+            pool.async([&filenames, &outputs, &errors, i]() {
+                SMDiagnostic err;
+                LLVMContext context;
+                auto module = parseIRFile(filenames[i], err, context);
+                if (!module) {
+                    raw_string_ostream os(errors[i]);
+                    err.print("llvm-epp", os);
+                    return;
+                }
+                instrumentModule(*module, filenames[i], &outputs[i]);
+            });
+        }
+        pool.wait();
+    }
+
+    int status = 0;
+    std::string encodings;
+    for (size_t i = 0; i < filenames.size(); i++) {
+        if (!errors[i].empty()) {
+            errs() << "Error reading bitcode file " << filenames[i] << ".\n"
+                   << errors[i];
+            status = -1;
+            continue;
+        }
+        errs() << outputs[i].Report;
+        encodings += outputs[i].Encodings;
+    }
+    appendEncodingFile(profileOutputFilename + ".enc", encodings);
+    return status;
 }
 
 void interpretResults(Module &module, std::string filename) {
+    // The paths are folded on the prepared module, which has extra blocks.
+    // The branch weights are saved on a copy of the input module instead.
+    bool annotate = superblocksFilename.empty() && outlineFilename.empty() &&
+                    !annotatedFilename.empty();
+    ValueToValueMapTy vmap;
+    unique_ptr<Module> original;
+    if (annotate)
+        original = CloneModule(&module, vmap);
+
     legacy::PassManager pm;
     pm.add(createLoopSimplifyPass());
     pm.add(new epp::BreakSelfLoopsPass());
@@ -142,9 +343,99 @@ void interpretResults(Module &module, std::string filename) {
     pm.add(new epp::SplitLandingPadPredsPass());
     pm.add(new LoopInfoWrapperPass());
     pm.add(new epp::EPPDecode());
-    pm.add(new epp::EPPPathPrinter());
+    if (!superblocksFilename.empty())
+        pm.add(new epp::EPPSuperblock());
+    else if (!outlineFilename.empty())
+        pm.add(new epp::EPPOutline());
+    else if (annotatedFilename.empty() && sampleProfileFilename.empty())
+        pm.add(new epp::EPPPathPrinter());
+    else
+        pm.add(new epp::EPPEdgeProfile());
     pm.add(createVerifierPass());
     pm.run(module);
+
+    if (!superblocksFilename.empty())
+        saveModule(module, superblocksFilename);
+    else if (!outlineFilename.empty())
+        saveModule(module, outlineFilename);
+    else if (annotate) {
+        copyBranchWeights(module, vmap);
+        saveModule(*original, annotatedFilename);
+    }
+}
+
+/// Decoding only needs the functions with paths in the profile. Their
+/// bodies are read from the bitcode, the others are left unread and become
+/// declarations, so that neither preparing nor encoding the module touches
+/// them.
+bool materializeProfiled(Module &M, StringRef ProfileFilename) {
+    auto Profiled = getProfiledFunctions(ProfileFilename);
+    for (auto &F : M) {
+        if (!F.isMaterializable())
+            continue;
+        if (!Profiled.count(getFunctionGUID(F))) {
+            F.deleteBody();
+            continue;
+        }
+        if (auto Err = F.materialize()) {
+            logAllUnhandledErrors(std::move(Err), errs(),
+                                  "Error reading " + F.getName() + ": ");
+            return false;
+        }
+    }
+    return true;
+}
+
+int mergeMain() {
+    vector<WeightedProfile> Inputs;
+    for (auto &Filename : mergeInputs)
+        Inputs.push_back({Filename, 1});
+    for (StringRef Input : weightedInputs) {
+        StringRef Weight, Filename;
+        tie(Weight, Filename) = Input.split(',');
+        uint64_t W;
+        if (Filename.empty() || Weight.getAsInteger(10, W) || W == 0) {
+            errs() << "Invalid weighted input " << Input
+                   << ", expected <weight>,<filename>.\n";
+            return -1;
+        }
+        Inputs.push_back({Filename.str(), W});
+    }
+    if (Inputs.empty()) {
+        errs() << "No profiles to merge.\n";
+        return -1;
+    }
+
+    error_code EC;
+    raw_fd_ostream Out(mergeOutput, EC, sys::fs::F_Text);
+    if (EC) {
+        errs() << "Could not open " << mergeOutput << ": " << EC.message()
+               << "\n";
+        return -1;
+    }
+    mergeProfiles(Inputs, Out, numJobs);
+    return 0;
+}
+
+int diffMain() {
+    auto Encodings = readEncodingFile(
+        encodingFilename.empty() ? diffNew + ".enc" : encodingFilename);
+    ProfileDiff Diff(
+        [&Encodings](uint64_t FunctionId) -> const FunctionEncoding * {
+            auto It = Encodings.find(FunctionId);
+            return It == Encodings.end() ? nullptr : It->second.get();
+        },
+        diffRanking, diffTop);
+    Diff.print(diffOld, diffNew, outs());
+    return 0;
+}
+
+int queryMain() {
+    queryProfile(queryProfileFilename,
+                 encodingFilename.empty() ? queryProfileFilename + ".enc"
+                                          : encodingFilename,
+                 queryFunction);
+    return 0;
 }
 }
 
@@ -164,21 +455,64 @@ int main(int argc, char **argv, const char **env) {
         TargetRegistry::printRegisteredTargetsForVersion);
     cl::ParseCommandLineOptions(argc, argv);
 
+    if (MergeCommand)
+        return mergeMain();
+    if (DiffCommand)
+        return diffMain();
+
+    if (coverage <= 0.0 || coverage > 1.0) {
+        errs() << "The coverage must be in (0, 1].\n";
+        return -1;
+    }
+
+    if (QueryCommand)
+        return queryMain();
+
+    // Decoding without the module uses the encoding file written when
+    // the module was instrumented.
+    if (inPaths.empty()) {
+        if (profile.empty()) {
+            errs() << "A module is required for instrumentation.\n";
+            return -1;
+        }
+        auto EncodingFile = encodingFilename.empty()
+                                ? profile + ".enc"
+                                : encodingFilename.getValue();
+        printProfileWithEncodingFile(profile, EncodingFile);
+        return 0;
+    }
+
+    if (inPaths.size() > 1) {
+        if (!profile.empty()) {
+            errs() << "A profile is decoded with a single module.\n";
+            return -1;
+        }
+        return instrumentModules(inPaths);
+    }
+
     // Construct an IR file from the filename passed on the command line.
+    // Function bodies are read lazily when decoding, unless the module is
+    // saved again.
     SMDiagnostic err;
     LLVMContext context;
-    unique_ptr<Module> module = parseIRFile(inPath.getValue(), err, context);
+    bool lazy = !profile.empty() && annotatedFilename.empty() &&
+                superblocksFilename.empty() && outlineFilename.empty();
+    unique_ptr<Module> module =
+        lazy ? getLazyIRFileModule(inPaths[0], err, context)
+             : parseIRFile(inPaths[0], err, context);
 
     if (!module.get()) {
         errs() << "Error reading bitcode file.\n";
         err.print(argv[0], errs());
         return -1;
     }
+    if (lazy && !materializeProfiled(*module, profile))
+        return -1;
 
     if (!profile.empty()) {
         interpretResults(*module, profile.getValue());
     } else {
-        instrumentModule(*module);
+        instrumentModule(*module, inPaths[0]);
     }
 
     return 0;